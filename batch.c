@@ -0,0 +1,298 @@
+// Headless batch engine: many independent games of breakout stepped in
+// lockstep, one game per SIMD lane
+//
+// Meant for balancing and AI training runs, where nothing is rendered and the
+// only thing that matters is how many games go through per second. Include it
+// after breakout.c: it reuses the chamber's geometry, and follows step() and
+// apply_brick_collision() operation for operation, so that every lane ends up
+// with the same bits as the scalar chamber given the same inputs (see
+// tools/headless.c --verify). Build with -ffp-contract=off so that neither
+// side gets its multiply-adds fused.
+//
+// The chamber itself leaves moving balls to the host. Headless games have no
+// host, so batch_step() also does what the sphaero host would: move each ball
+// by its velocity and bounce it off the walls of the chamber, see move_ball().
+// Surfaces and power-ups are not simulated.
+//
+// Vectors use the GCC/clang vector extensions, which map to SSE/AVX natively
+// and to simd128 in wasm builds with -msimd128.
+
+#include "./physics_inline.h"
+
+#ifdef PHYSICS_FIXED
+#error "the batch engine follows the float step(), build it without PHYSICS_FIXED"
+#endif
+
+#ifndef BATCH_LANES
+#define BATCH_LANES 4
+#endif
+
+typedef float batch_f32 __attribute__((vector_size(BATCH_LANES * sizeof(float))));
+typedef int32_t batch_i32 __attribute__((vector_size(BATCH_LANES * sizeof(int32_t))));
+
+// Same bits as SaveState.brick_save, in 32-bit words
+#define BRICK_WORDS ((BRICKS_PER_ROW * BRICK_ROWS + 31) / 32)
+
+typedef struct
+{
+    batch_f32 x;
+    batch_f32 y;
+    batch_f32 r;
+    batch_f32 vx;
+    batch_f32 vy;
+} BallLanes;
+
+// BATCH_LANES games
+typedef struct
+{
+    batch_i32 bricks[BRICK_WORDS]; // Word w of every lane's destroyed bricks bitset
+    batch_i32 bricks_count;
+    batch_i32 game_count;
+    BallLanes balls[]; // balls_per_game of them
+} GameBlock;
+
+typedef struct
+{
+    size_t games; // Multiple of BATCH_LANES
+    size_t balls_per_game;
+    size_t block_count;
+    size_t block_size;
+    size_t tick; // Steps run, the same for every game
+    uint8_t *blocks_memory; // Allocation blocks live in, unaligned
+    uint8_t *blocks;
+    uint64_t bricks_destroyed;
+    uint64_t levels_cleared;
+} Batch;
+
+static GameBlock *batch_block(Batch *batch, size_t block)
+{
+    return (GameBlock *)(batch->blocks + block * batch->block_size);
+}
+
+/**
+ * Set up room for games games of balls_per_game balls each. games is rounded
+ * up to a multiple of BATCH_LANES. Every game starts at level 0 with all
+ * bricks up, balls are set with batch_set_ball()
+ *
+ * Returns false if memory ran out
+ */
+bool batch_init(Batch *batch, size_t games, size_t balls_per_game)
+{
+    const size_t align = sizeof(batch_f32);
+    batch->games = (games + BATCH_LANES - 1) / BATCH_LANES * BATCH_LANES;
+    batch->balls_per_game = balls_per_game;
+    batch->block_count = batch->games / BATCH_LANES;
+    batch->block_size = sizeof(GameBlock) + balls_per_game * sizeof(BallLanes);
+    batch->blocks_memory = malloc(batch->block_count * batch->block_size + align);
+    if (!batch->blocks_memory)
+        return false;
+    batch->blocks = (uint8_t *)(((uintptr_t)batch->blocks_memory + align - 1) & ~(uintptr_t)(align - 1));
+    batch->tick = 0;
+    batch->bricks_destroyed = 0;
+    batch->levels_cleared = 0;
+
+    mymemset(batch->blocks, 0, batch->block_count * batch->block_size);
+    for (size_t i = 0; i < batch->block_count; i++)
+    {
+        GameBlock *block = batch_block(batch, i);
+        for (size_t lane = 0; lane < BATCH_LANES; lane++)
+        {
+            block->bricks_count[lane] = BRICKS_PER_ROW * BRICK_ROWS;
+        }
+    }
+    return true;
+}
+
+void batch_deinit(Batch *batch)
+{
+    free(batch->blocks_memory);
+    batch->blocks_memory = NULL;
+    batch->blocks = NULL;
+}
+
+void batch_set_ball(Batch *batch, size_t game, size_t index, const struct ball *ball)
+{
+    BallLanes *lanes = &batch_block(batch, game / BATCH_LANES)->balls[index];
+    const size_t lane = game % BATCH_LANES;
+    lanes->x[lane] = ball->pos.x;
+    lanes->y[lane] = ball->pos.y;
+    lanes->r[lane] = ball->r;
+    lanes->vx[lane] = ball->velocity.x;
+    lanes->vy[lane] = ball->velocity.y;
+}
+
+struct ball batch_get_ball(Batch *batch, size_t game, size_t index)
+{
+    const BallLanes *lanes = &batch_block(batch, game / BATCH_LANES)->balls[index];
+    const size_t lane = game % BATCH_LANES;
+    return (struct ball){{lanes->x[lane], lanes->y[lane]}, lanes->r[lane], {lanes->vx[lane], lanes->vy[lane]}};
+}
+
+/**
+ * Copy the chamber state of one game, in the layout of SaveState
+ */
+void batch_get_state(Batch *batch, size_t game, SaveState *out)
+{
+    const GameBlock *block = batch_block(batch, game / BATCH_LANES);
+    const size_t lane = game % BATCH_LANES;
+    mymemset(out, 0, sizeof(*out));
+    out->bricks_count = block->bricks_count[lane];
+    out->game_count = block->game_count[lane];
+    out->current_color_func = out->game_count % COLOR_FUNC_COUNT;
+    out->tick = batch->tick;
+    for (size_t i = 0; i < BRICK_SAVE_SIZE; i++)
+    {
+        out->brick_save[i] = (uint32_t)block->bricks[i / 4][lane] >> (i % 4 * 8);
+    }
+}
+
+#define SIGN_BIT ((int32_t)0x80000000)
+
+static inline batch_f32 select_f32(batch_i32 mask, batch_f32 a, batch_f32 b)
+{
+    return (batch_f32)((mask & (batch_i32)a) | (~mask & (batch_i32)b));
+}
+
+static inline batch_i32 select_i32(batch_i32 mask, batch_i32 a, batch_i32 b)
+{
+    return (mask & a) | (~mask & b);
+}
+
+static inline batch_f32 flip_sign(batch_i32 mask, batch_f32 v)
+{
+    return (batch_f32)((batch_i32)v ^ (mask & SIGN_BIT));
+}
+
+static inline batch_f32 abs_f32(batch_f32 v)
+{
+    return (batch_f32)((batch_i32)v & ~SIGN_BIT);
+}
+
+static inline batch_i32 clamp_cell(batch_i32 cell, int32_t cells)
+{
+    cell = select_i32(cell <= 0, (batch_i32){0} + 1, cell);
+    return select_i32(cell >= cells - 1, (batch_i32){0} + (cells - 2), cell);
+}
+
+static inline int32_t lane_count(batch_i32 mask)
+{
+    int32_t count = 0;
+    for (size_t lane = 0; lane < BATCH_LANES; lane++)
+    {
+        count -= mask[lane];
+    }
+    return count;
+}
+
+FLOAT_ONLY_BEGIN
+
+// step() for one ball of each game of block
+static void step_ball_lanes(GameBlock *block, BallLanes *ball, float delta, Batch *batch)
+{
+    const batch_f32 r = ball->r;
+    ball->vy = ball->vy - PHYSICS_GRAVITY * delta;
+    const batch_f32 final_x = ball->x + ball->vx * delta;
+    const batch_f32 final_y = ball->y + ball->vy * delta;
+
+    const batch_i32 cell_x = clamp_cell(
+        __builtin_convertvector((final_x - MARGIN_X) / (BRICK_WIDTH + BRICK_GAP_X), batch_i32), BRICKS_PER_ROW);
+    const batch_i32 cell_y = clamp_cell(
+        __builtin_convertvector((FIELD_HEIGHT - final_y - MARGIN_Y) / (BRICK_HEIGHT + BRICK_GAP_Y), batch_i32), BRICK_ROWS);
+
+    batch_i32 collided = {0};
+    for (int32_t dx = -1; dx <= 1; dx++)
+    {
+        const batch_i32 column = cell_x + dx;
+        const batch_f32 left = MARGIN_X + __builtin_convertvector(column, batch_f32) * (BRICK_WIDTH + BRICK_GAP_X);
+        for (int32_t dy = -1; dy <= 1; dy++)
+        {
+            const batch_i32 row = cell_y + dy;
+            const batch_f32 top = FIELD_HEIGHT - (MARGIN_Y + __builtin_convertvector(row, batch_f32) * (BRICK_HEIGHT + BRICK_GAP_Y));
+
+            const batch_i32 indice = column + row * BRICKS_PER_ROW;
+            const batch_i32 word = indice >> 5;
+            const batch_i32 bit = ((batch_i32){0} + 1) << (indice & 31);
+            batch_i32 destroyed = {0};
+            for (int32_t w = 0; w < BRICK_WORDS; w++)
+            {
+                destroyed |= (word == w) & block->bricks[w];
+            }
+
+            // apply_brick_collision(), for the lanes still looking for one
+            const batch_i32 candidate = ~collided & ((destroyed & bit) == 0) &
+                                        ~((final_x + r < left) | (final_x - r > left + BRICK_WIDTH)) &
+                                        ~((final_y - r > top) | (final_y + r < top - BRICK_HEIGHT));
+            const batch_i32 hit_y = candidate &
+                                    (((ball->y - r > top) & (final_y - r <= top)) |
+                                     ((ball->y + r < top - BRICK_HEIGHT) & (final_y + r >= top - BRICK_HEIGHT)));
+            const batch_i32 hit_x = candidate &
+                                    (((ball->x + r < left) & (final_x + r >= left)) |
+                                     ((ball->x - r > left + BRICK_WIDTH) & (final_x - r <= left + BRICK_WIDTH)));
+            const batch_i32 collision = hit_x | hit_y;
+
+            ball->vy = flip_sign(hit_y, ball->vy);
+            ball->vx = flip_sign(hit_x, ball->vx);
+            for (int32_t w = 0; w < BRICK_WORDS; w++)
+            {
+                block->bricks[w] |= (word == w) & collision & bit;
+            }
+            block->bricks_count += collision;
+            batch->bricks_destroyed += lane_count(collision);
+            collided |= collision;
+        }
+    }
+}
+
+// move_ball() for one ball of each game of block, same operations
+static void move_ball_lanes(BallLanes *ball, float delta)
+{
+    const batch_f32 r = ball->r;
+    ball->x = ball->x + ball->vx * delta;
+    ball->y = ball->y + ball->vy * delta;
+
+    batch_i32 hit = ball->x < r;
+    ball->x = select_f32(hit, r, ball->x);
+    ball->vx = select_f32(hit, abs_f32(ball->vx), ball->vx);
+    hit = ball->x > 1.0f - r;
+    ball->x = select_f32(hit, 1.0f - r, ball->x);
+    ball->vx = select_f32(hit, -abs_f32(ball->vx), ball->vx);
+    hit = ball->y < r;
+    ball->y = select_f32(hit, r, ball->y);
+    ball->vy = select_f32(hit, abs_f32(ball->vy), ball->vy);
+    hit = ball->y > FIELD_HEIGHT - r;
+    ball->y = select_f32(hit, FIELD_HEIGHT - r, ball->y);
+    ball->vy = select_f32(hit, -abs_f32(ball->vy), ball->vy);
+}
+
+/**
+ * Advance every game by delta seconds: step() on its balls, in order, then
+ * move_ball() on each of them
+ */
+void batch_step(Batch *batch, float delta)
+{
+    for (size_t i = 0; i < batch->block_count; i++)
+    {
+        GameBlock *block = batch_block(batch, i);
+        for (size_t b = 0; b < batch->balls_per_game; b++)
+        {
+            step_ball_lanes(block, &block->balls[b], delta, batch);
+        }
+
+        const batch_i32 cleared = block->bricks_count == 0;
+        for (int32_t w = 0; w < BRICK_WORDS; w++)
+        {
+            block->bricks[w] &= ~cleared;
+        }
+        block->bricks_count = select_i32(cleared, (batch_i32){0} + BRICKS_PER_ROW * BRICK_ROWS, block->bricks_count);
+        block->game_count -= cleared;
+        batch->levels_cleared += lane_count(cleared);
+
+        for (size_t b = 0; b < batch->balls_per_game; b++)
+        {
+            move_ball_lanes(&block->balls[b], delta);
+        }
+    }
+    batch->tick++;
+}
+
+FLOAT_ONLY_END
@@ -1,19 +1,53 @@
 #include <stdint.h>
+#if defined(CHAMBER_THREADS) && !defined(__wasm__)
+#include <pthread.h>
+#endif
 
+#ifdef PHYSICS_INLINE
+#include "./physics_inline.h"
+#else
 #include "./physics.h"
+#endif
+#ifdef PHYSICS_FIXED
+#include "./physics_fixed.h"
+#endif
 #include "walloc.c"
 
 #define BRICKS_PER_ROW 9
 #define BRICK_ROWS 12
+#define BRICK_SAVE_SIZE ((BRICKS_PER_ROW * BRICK_ROWS + 7) / 8)
+
+// The chamber is 1.0 wide and FIELD_HEIGHT high, y pointing up
+#define FIELD_HEIGHT 0.7f
 
 #define BRICK_WIDTH 1.0f / 12.0f
-#define BRICK_HEIGHT 0.7f / 25.0f
+#define BRICK_HEIGHT FIELD_HEIGHT / 25.0f
 
 #define BRICK_GAP_X 1.0f / 80.0f
-#define BRICK_GAP_Y 0.7f / 70.0f
+#define BRICK_GAP_Y FIELD_HEIGHT / 70.0f
 
 const static float MARGIN_X = (1.0f - BRICK_WIDTH * BRICKS_PER_ROW - BRICK_GAP_X * (BRICKS_PER_ROW - 1)) / 2.0f;
-const static float MARGIN_Y = (0.7f - BRICK_HEIGHT * BRICK_ROWS - BRICK_GAP_Y * (BRICK_ROWS - 1)) / 2.0f;
+const static float MARGIN_Y = (FIELD_HEIGHT - BRICK_HEIGHT * BRICK_ROWS - BRICK_GAP_Y * (BRICK_ROWS - 1)) / 2.0f;
+
+#ifdef PHYSICS_FIXED
+// The same geometry on the Q16.16 grid, derived with integer math only
+#define FIXED_FIELD_HEIGHT FIXED_CONST(0.7)
+#define FIXED_BRICK_WIDTH FIXED_CONST(1.0 / 12.0)
+#define FIXED_BRICK_HEIGHT FIXED_CONST(0.7 / 25.0)
+#define FIXED_BRICK_GAP_X FIXED_CONST(1.0 / 80.0)
+#define FIXED_BRICK_GAP_Y FIXED_CONST(0.7 / 70.0)
+#define FIXED_MARGIN_X ((FIXED_ONE - FIXED_BRICK_WIDTH * BRICKS_PER_ROW - FIXED_BRICK_GAP_X * (BRICKS_PER_ROW - 1)) / 2)
+#define FIXED_MARGIN_Y \
+    ((FIXED_FIELD_HEIGHT - FIXED_BRICK_HEIGHT * BRICK_ROWS - FIXED_BRICK_GAP_Y * (BRICK_ROWS - 1)) / 2)
+#endif
+
+// step() and the helpers it calls are float only: double arithmetic is slower
+// in wasm and keeps the per-ball loop from being vectorized. Any implicit
+// promotion to double between these markers is a compile error
+#define FLOAT_ONLY_BEGIN                 \
+    _Pragma("GCC diagnostic push")       \
+        _Pragma("GCC diagnostic error \"-Wdouble-promotion\"")
+#define FLOAT_ONLY_END _Pragma("GCC diagnostic pop")
 
 __attribute__((import_module("env"), import_name("logWasm"))) void logWasm(char *str, size_t len);
 
@@ -66,14 +100,395 @@ typedef struct
     size_t bricks_count;
     size_t game_count;
     size_t current_color_func;
+    size_t chamber_balls; // Live chamber balls, saved right after the SaveState
+    size_t tick;          // Number of step() calls this state is the result of
     // Each brick gets 1 bit of data, to save space
-    uint8_t brick_save[BRICK_ROWS * BRICKS_PER_ROW / 8];
+    uint8_t brick_save[BRICK_SAVE_SIZE];
 } SaveState;
 
+// Commands the host can queue in the command ring, see pump()
+typedef enum
+{
+    COMMAND_STEP,   // step(arg0, delta)
+    COMMAND_RENDER, // render(arg0, arg1)
+    COMMAND_SAVE,   // save()
+    COMMAND_LOAD,   // load()
+} CommandType;
+
+typedef struct
+{
+    uint32_t type;
+    uint32_t arg0;
+    uint32_t arg1;
+    float delta;
+} Command;
+
+typedef struct
+{
+    uint32_t type;
+    uint32_t sequence;     // Position of the command in the command stream
+    uint32_t bricks_count; // Chamber state once the command has run
+    uint32_t game_count;
+} CommandResult;
+
+// Must be a power of two, head and tail wrap around freely
+#define RING_CAPACITY 64
+
+// Single producer/single consumer rings. Whoever produces entries owns head,
+// whoever consumes them owns tail. Both only ever increase, the slot of an
+// index is index % RING_CAPACITY
+typedef struct
+{
+    uint32_t head;
+    uint32_t tail;
+    Command entries[RING_CAPACITY];
+} CommandRing;
+
+typedef struct
+{
+    uint32_t head;
+    uint32_t tail;
+    CommandResult entries[RING_CAPACITY];
+} ResultRing;
+
+// Events step() reports through eventsMemory()
+typedef enum
+{
+    EVENT_BRICK_DESTROYED,  // x, y of the brick, value = ball index (num_balls + handle for chamber balls)
+    EVENT_LEVEL_CLEARED,    // value = game_count of the new level
+    EVENT_PALETTE_SWITCHED, // value = index of the new color function
+} EventType;
+
+typedef struct
+{
+    uint8_t type;
+    uint8_t x;
+    uint8_t y;
+    uint8_t padding;
+    uint32_t value;
+    float time; // Seconds into the step() that produced the event
+} Event;
+
+// Must be a power of two
+#define EVENT_RING_CAPACITY 256
+
+// Same single producer/single consumer scheme as the command rings, with the
+// chamber producing. When the host falls behind, new events are dropped and
+// counted rather than overwriting ones it has not read yet
+typedef struct
+{
+    uint32_t head;
+    uint32_t tail;
+    uint32_t dropped;
+    uint32_t padding;
+    Event entries[EVENT_RING_CAPACITY];
+} EventRing;
+
+// Canvas pixel layouts, see setPixelFormat()
+typedef enum
+{
+    PIXEL_FORMAT_RGBA8888, // u32 0xaabbggrr, the default
+    PIXEL_FORMAT_INDEXED8, // u8 index into paletteMemory()
+    PIXEL_FORMAT_RGB565,   // u16 rrrrrggggggbbbbb
+} PixelFormat;
+
+// What render() produces, see setRenderMode()
+typedef enum
+{
+    RENDER_RASTER,    // Pixels in canvasMemory()
+    RENDER_DRAW_LIST, // DrawRects in drawListMemory()
+} RenderMode;
+
+// One solid rectangle of a draw list. Drawing the rectangles in order, each
+// one over the previous ones, gives the frame render() would rasterize
+typedef struct
+{
+    uint16_t x;
+    uint16_t y;
+    uint16_t width;
+    uint16_t height;
+    uint32_t color; // 0xaabbggrr
+} DrawRect;
+
+// Background plus every brick and particle
+#define DRAW_LIST_CAPACITY (1 + BRICK_ROWS * BRICKS_PER_ROW + MAX_PARTICLES)
+
+// Up to triple buffering, see setCanvasBuffers()
+#define MAX_CANVAS_BUFFERS 3
+#define NO_CANVAS MAX_CANVAS_BUFFERS
+
+// What a canvas buffer currently shows, so that the next frame rendered into
+// it only has to touch the bricks that changed since
+typedef struct
+{
+    bool valid;
+    size_t width;
+    size_t height;
+    size_t color_func;
+    bool particles; // Debris was drawn over the bricks
+    uint32_t overlay_version;
+    uint8_t bricks[BRICK_SAVE_SIZE];
+} CanvasFrame;
+
+// Walls, paddle and deflectors, see setSurfaces()
+#define MAX_SURFACES 512
+#define MAX_SURFACE_NODES (2 * MAX_SURFACES - 1)
+#define SURFACE_LEAF_SIZE 4
+#define SURFACE_STACK_SIZE 32
+
+// A segment balls bounce off. Only its normal side collides (see struct
+// surface), a two-sided obstacle is two surfaces
+typedef struct
+{
+    struct surface surface;
+    struct vec2 velocity; // Of a moving surface such as the paddle, zero otherwise
+    float elasticity;     // 1 keeps the ball's speed
+} ChamberSurface;
+
+// Node of the bounding volume hierarchy over the surfaces, see
+// build_surface_node()
+typedef struct
+{
+    float min_x;
+    float min_y;
+    float max_x;
+    float max_y;
+    uint16_t first; // Left child, the right one follows it, or first entry of surface_order in a leaf
+    uint16_t count; // Surfaces in a leaf, 0 for an inner node
+} SurfaceNode;
+
+// Balls spawned by power-up bricks, see setPowerUps()
+#define MAX_CHAMBER_BALLS 1024
+#define NO_BALL_HANDLE UINT32_MAX
+#define POWER_UP_PERIOD 13 // About one brick in POWER_UP_PERIOD is a power-up
+#define POWER_UP_BALLS 2   // Balls spawned by each power-up
+#define POWER_UP_BALL_LIFETIME 8.0f // Seconds
+
+// Pool of the balls the chamber spawns itself. They sit in a dense array that
+// step() walks like ballsMemory(). Removing a ball leaves a hole (r == 0, no
+// handle) in its slot until compact_ball_pool() closes the holes. The host
+// can follow a ball through compactions by its handle, see chamberBallSlot()
+typedef struct
+{
+    size_t end;  // Slots in use, holes included
+    size_t holes;
+    uint32_t free_handle; // Head of the free list, threaded through slot_of
+    struct ball *balls;
+    float *life; // Seconds left
+    uint32_t *handle_of; // Slot -> handle, NO_BALL_HANDLE for holes
+    uint32_t *slot_of;   // Handle -> slot, or next free handle
+} BallPool;
+
+// A chamber ball as save() writes it after the SaveState
+typedef struct
+{
+    struct ball ball;
+    float life;
+    uint32_t handle;
+} SavedBall;
+
+// Layout of saveMemory(), see setSaveFormat()
+typedef enum
+{
+    SAVE_FORMAT_RAW,     // The SaveState as is, then the SavedBalls
+    SAVE_FORMAT_COMPACT, // See save_compact()
+} SaveFormat;
+
+// First byte of a SAVE_FORMAT_COMPACT save
+#define SAVE_COMPACT_TAG 0xb5
+// Longest LEB128 encoding of a size_t
+#define MAX_VARINT_SIZE ((sizeof(size_t) * 8 + 6) / 7)
+// Longest encode_bits() output for bytes bytes: one literal run
+#define MAX_ENCODED_BITS_SIZE(bytes) (MAX_VARINT_SIZE + (bytes))
+// Shortest run of equal bytes worth a fill token
+#define MIN_FILL_RUN 4
+// Tag, five counters and the bricks, padded for the SavedBalls
+#define MAX_COMPACT_HEADER_SIZE \
+    (1 + 5 * MAX_VARINT_SIZE + MAX_ENCODED_BITS_SIZE(BRICK_SAVE_SIZE) + _Alignof(SavedBall))
+#define MAX_SAVE_HEADER_SIZE \
+    (sizeof(SaveState) > MAX_COMPACT_HEADER_SIZE ? sizeof(SaveState) : MAX_COMPACT_HEADER_SIZE)
+
+#define MAX_SAVE_SIZE (MAX_SAVE_HEADER_SIZE + MAX_CHAMBER_BALLS * sizeof(SavedBall))
+
+// Steps a predicting client can run ahead of the last snapshot it loaded, see
+// setPrediction()
+#define PREDICTION_HISTORY 64
+
+// Input of one step() run by a predicting client. The balls it started from
+// are kept next to it, in predicted_balls
+typedef struct
+{
+    size_t tick; // state->tick before the step
+    size_t num_balls;
+    float delta;
+} PredictedStep;
+
+// Debris of destroyed bricks, see spawn_debris()
+#ifndef MAX_PARTICLES
+#define MAX_PARTICLES 32768
+#endif
+#define PARTICLES_PER_BRICK 24
+#define PARTICLE_LIFETIME 0.8f // Seconds, at most
+#define PARTICLE_GRAVITY 2.0f
+#define PARTICLE_SIZE 2 // Pixels
+
+// Fixed-capacity pool of particles, one array per field so that
+// update_particles() vectorizes. Live particles are [0, count): spawning
+// appends, despawning moves the last particle into the hole
+typedef struct
+{
+    size_t count;
+    float *x; // Chamber coordinates, like balls
+    float *y;
+    float *vx;
+    float *vy;
+    float *life; // Seconds left
+    uint32_t *color; // 0xaabbggrr
+} ParticlePool;
+
+// How bricks are drawn, see setBrickStyle()
+typedef enum
+{
+    BRICK_STYLE_FLAT,  // One colour, filled in place
+    BRICK_STYLE_BEVEL, // Lit top and left edges, shaded bottom and right ones
+} BrickStyle;
+
+// Bricks are drawn in a style other than flat by copying rows out of sprites,
+// rasterized once per colour whenever the brick size (canvas size), pixel
+// format or colours (level) change. Every brick has the same pixel size, so
+// bricks of one colour share a sprite. Bricks have no damage states yet, a
+// brick is either standing or gone
+typedef struct
+{
+    bool valid;
+    size_t width; // Of a brick, in pixels
+    size_t height;
+    size_t color_func;
+    PixelFormat format;
+    BrickStyle style;
+    size_t count;                                   // Sprites in use
+    uint32_t colors[BRICKS_PER_ROW * BRICK_ROWS];   // 0xaabbggrr colour of each sprite
+    uint8_t sprite_of[BRICKS_PER_ROW * BRICK_ROWS]; // Sprite each brick is drawn with
+    uint8_t *pixels; // count sprites of width * height pixels, max_canvas_size pixels in total
+} SpriteCache;
+
+// Most recent level clears kept in Telemetry
+#define TELEMETRY_LEVELS 64
+// A ball tests at most the 3x3 bricks around its cell
+#define TELEMETRY_MAX_TESTS 9
+
+// Collision statistics gathered by step() while setTelemetry() is on. Plain
+// counters bumped in place, so the host can read them at any time from
+// telemetryMemory(). Cells are indexed x + y * BRICKS_PER_ROW
+//
+// A ball step only bumps one counter, in cell_tests: per cell visits and the
+// histogram of tests are its row and column sums
+typedef struct
+{
+    uint32_t steps;       // step() calls since telemetry was turned on
+    uint32_t levels;      // Levels cleared since then
+    uint32_t level_steps; // step() calls into the current level
+    float level_time;     // Seconds into the current level
+    uint32_t brick_hits[BRICKS_PER_ROW * BRICK_ROWS]; // Bricks destroyed in each cell
+    // Ball steps whose broad phase was centred on each cell, by how many
+    // standing bricks they tested for a collision
+    uint32_t cell_tests[BRICKS_PER_ROW * BRICK_ROWS][TELEMETRY_MAX_TESTS + 1];
+    // Steps and seconds each level took to clear, level i at i % TELEMETRY_LEVELS
+    uint32_t clear_steps[TELEMETRY_LEVELS];
+    float clear_time[TELEMETRY_LEVELS];
+} Telemetry;
+
+// Text overlay in the bottom left corner of the canvas, see setOverlay()
+typedef enum
+{
+    OVERLAY_SCORE = 1,  // Bricks destroyed since init()
+    OVERLAY_LEVEL = 2,  // game_count
+    OVERLAY_LEFT = 4,   // Bricks left in this level
+    OVERLAY_DEBUG = 8,  // Value passed to setOverlayStat(), e.g. step time
+} OverlayFlag;
+
+#define OVERLAY_MAX_CHARS 48
+#define OVERLAY_SCALE 2 // Canvas pixels per font pixel
+#define OVERLAY_MARGIN 2
+// Glyphs are 3x5 font pixels, with one pixel of spacing on each side
+#define OVERLAY_WIDTH (OVERLAY_MAX_CHARS * 4 * OVERLAY_SCALE)
+#define OVERLAY_HEIGHT (7 * OVERLAY_SCALE)
+
+// What the host is going to use this instance for, derived from the sizes
+// passed to init(). Buffers a role never touches are never allocated: no
+// canvas, draw list, debris, sprites or overlay on a server, no surfaces or
+// telemetry on a client, whose balls only ever come from load()
+typedef enum
+{
+    ROLE_SERVER, // max_canvas_size == 0, render() is never called
+    ROLE_CLIENT, // max_num_balls == 0, only load() and render() are called
+    ROLE_FULL,
+} ChamberRole;
+
+static ChamberRole role = ROLE_FULL;
+static size_t max_balls = 0;
+static size_t max_canvas_size = 0;
+
+// Allocated lazily on first use, see ensure_xxx() below
 static struct ball *balls_memory = NULL;
-static int32_t *canvas_memory = NULL;
+static PixelFormat pixel_format = PIXEL_FORMAT_RGBA8888;
+static SaveFormat save_format = SAVE_FORMAT_RAW;
+static size_t save_length = 0; // Bytes written by the last save()
+static uint8_t *canvas_buffers[MAX_CANVAS_BUFFERS] = {0};
+static CanvasFrame canvas_frames[MAX_CANVAS_BUFFERS] = {0};
+static size_t canvas_buffer_count = 1;
+static size_t front_canvas = 0;        // Returned by canvasMemory()
+static size_t back_canvas = 0;         // Next render() draws here
+static size_t ready_canvas = NO_CANVAS; // Latest complete frame, not shown yet
+static uint8_t *canvas_memory = NULL;  // Buffer render() is drawing into
 static SaveState *state = NULL;
 static uint8_t *save_data = NULL;
+static size_t save_capacity = 0; // Bytes allocated at save_data
+static RenderMode render_mode = RENDER_RASTER;
+static DrawRect *draw_list = NULL;
+static size_t draw_list_count = 0;
+static CommandRing *command_ring = NULL;
+static ResultRing *result_ring = NULL;
+static ChamberSurface *surfaces = NULL;
+static SurfaceNode *surface_nodes = NULL;
+static uint16_t *surface_order = NULL; // Surface indices, grouped by leaf
+static size_t surface_count = 0;
+static size_t surface_node_count = 0;
+static ParticlePool particles = {0};
+static BallPool ball_pool = {0};
+static bool power_ups = false;
+static PredictedStep *predicted_steps = NULL; // Ring of PREDICTION_HISTORY steps
+static struct ball *predicted_balls = NULL;   // max_balls per predicted step
+static struct ball *replay_balls = NULL;      // What replayed steps run on
+static size_t predicted_head = 0;
+static size_t predicted_tail = 0;
+static bool replaying = false;
+static Telemetry *telemetry = NULL;
+static uint32_t *binned_order = NULL;     // Ball indices by cell, see setBallBinning()
+static uint16_t *binned_cell = NULL;      // Cell of each ball
+static struct pos2 *binned_final = NULL;  // Where each ball ends up without a brick
+static BrickStyle brick_style = BRICK_STYLE_FLAT;
+static SpriteCache sprite_cache = {0};
+static size_t overlay_flags = 0;
+static size_t overlay_stat = 0;
+static char overlay_text[OVERLAY_MAX_CHARS];
+static size_t overlay_length = 0;
+static uint32_t overlay_version = 0;   // Bumped whenever overlay_strip changes
+static uint8_t *overlay_strip = NULL;  // The text pre-rendered, in pixel_format
+static PixelFormat overlay_strip_format = PIXEL_FORMAT_RGBA8888;
+
+// Left and top edges of each column and row of bricks in chamber coordinates,
+// see compute_brick_geometry()
+static float brick_left[BRICKS_PER_ROW];
+static float brick_top[BRICK_ROWS];
+#ifdef PHYSICS_FIXED
+static fixed fixed_brick_left[BRICKS_PER_ROW];
+static fixed fixed_brick_top[BRICK_ROWS];
+#endif
+static EventRing event_ring = {0};
+
+// Last game_count seen by render()
+size_t game_count = 0;
 
 static double sqrt(double x)
 {
@@ -95,6 +510,11 @@ float fminf(float x, float y)
     return x < y ? x : y;
 }
 
+float fmaxf(float x, float y)
+{
+    return x > y ? x : y;
+}
+
 // pseudorandom number generator
 static uint32_t seed = 12;
 uint32_t rand()
@@ -103,275 +523,2230 @@ uint32_t rand()
     return (seed / 65536) % 32768;
 }
 
-/**
- * How many bytes we should use from saveMemory()
- */
-size_t saveSize(void)
+static struct ball *ensure_balls_memory(void)
 {
-    return sizeof(SaveState);
+    if (!balls_memory && max_balls > 0)
+    {
+        balls_memory = malloc(max_balls * sizeof(struct ball));
+    }
+    return balls_memory;
 }
 
-/**
- * Since some code runs on the client, and some code runs on the server, we need
- * a way to propagate our state from one side to the other. The save/load API is
- * how we do this. Take any state from the physics side, serialize it,
- * deserialize with load on the client side before render() is called
- */
-void save(void)
+static size_t bytes_per_pixel(void)
 {
-    mymemcpy(save_data, state, saveSize());
+    switch (pixel_format)
+    {
+    case PIXEL_FORMAT_INDEXED8:
+        return 1;
+    case PIXEL_FORMAT_RGB565:
+        return 2;
+    default:
+        return 4;
+    }
 }
-void load(void)
+
+// Returns the front buffer
+static uint8_t *ensure_canvas_memory(void)
 {
-    mymemcpy(state, save_data, saveSize());
+    if (!canvas_buffers[0] && role != ROLE_SERVER)
+    {
+        for (size_t i = 0; i < canvas_buffer_count; i++)
+        {
+            canvas_buffers[i] = malloc(max_canvas_size * bytes_per_pixel());
+            canvas_frames[i].valid = false;
+        }
+    }
+    return canvas_buffers[front_canvas];
 }
 
-Brick get_brick(SaveState *state, size_t x, size_t y)
+static void free_canvas_buffers(void)
 {
-    size_t brick_indice = x + y * BRICKS_PER_ROW;
-    size_t brick_save_indice = brick_indice / 8;
-    size_t brick_save_bit = (brick_indice % 8);
-
-    return (Brick){
-        state->brick_save[brick_save_indice] & (1 << brick_save_bit)};
+    for (size_t i = 0; i < MAX_CANVAS_BUFFERS; i++)
+    {
+        free(canvas_buffers[i]);
+        canvas_buffers[i] = NULL;
+        canvas_frames[i].valid = false;
+    }
+    canvas_memory = NULL;
+    front_canvas = 0;
+    back_canvas = canvas_buffer_count > 1 ? 1 : 0;
+    ready_canvas = NO_CANVAS;
 }
 
-// Can only set false to true, TODO fix
-void set_brick(SaveState *state, size_t x, size_t y, Brick brick)
+// Room for a header only until the ball pool exists, chamber balls need it.
+// ensure_ball_pool() grows the buffer to MAX_SAVE_SIZE
+static uint8_t *ensure_save_data(void)
 {
-    size_t brick_indice = x + y * BRICKS_PER_ROW;
-    size_t brick_save_indice = brick_indice / 8;
-    size_t brick_save_bit = (brick_indice % 8);
-
-    state->brick_save[brick_save_indice] |= (brick.destroyed ? 1 : 0) << brick_save_bit;
+    if (!save_data)
+    {
+        save_capacity = ball_pool.balls ? MAX_SAVE_SIZE : MAX_SAVE_HEADER_SIZE;
+        save_data = malloc(save_capacity);
+    }
+    return save_data;
 }
 
-void reset_bricks(SaveState *state)
+static DrawRect *ensure_draw_list(void)
 {
-    mymemset(state->brick_save, 0, BRICK_ROWS * BRICKS_PER_ROW / 8);
-    for (size_t i = 0; i < BRICK_ROWS; i++)
+    if (!draw_list && role != ROLE_SERVER)
     {
-        for (size_t j = 0; j < BRICKS_PER_ROW; j++)
-        {
-            set_brick(state, j, i, (Brick){false});
-        }
+        draw_list = malloc(DRAW_LIST_CAPACITY * sizeof(DrawRect));
     }
+    return draw_list;
 }
 
-/**
- * Called one time in both server and client contexts. max_num_balls or
- * max_canvas_size may be 0, but in some contexts both will be set
- *
- * Use for one time initialization of chamber state, and ensure memory returned
- * by xxxMemory() calls are ready to go
- */
-void init(size_t max_num_balls, size_t max_canvas_size)
+// Surfaces, their hierarchy and its leaf order share one allocation
+static ChamberSurface *ensure_surfaces(void)
 {
-    max_num_balls = max_num_balls == 0 ? 100 : max_num_balls;
-
-    balls_memory = malloc(max_num_balls * sizeof(struct ball));
-    canvas_memory = malloc(max_canvas_size * sizeof(int32_t));
-    state = malloc(sizeof(SaveState));
-    save_data = malloc(saveSize());
-    state->bricks_count = BRICKS_PER_ROW * BRICK_ROWS;
-    state->current_color_func = 0;
-    state->game_count = 0;
-    reset_bricks(state);
+    if (!surfaces && role != ROLE_CLIENT)
+    {
+        surfaces = malloc(MAX_SURFACES * sizeof(ChamberSurface) + MAX_SURFACE_NODES * sizeof(SurfaceNode) +
+                          MAX_SURFACES * sizeof(uint16_t));
+        surface_nodes = (SurfaceNode *)(surfaces + MAX_SURFACES);
+        surface_order = (uint16_t *)(surface_nodes + MAX_SURFACE_NODES);
+    }
+    return surfaces;
 }
 
-const struct vec2 NULL_VEC2 = {0};
-
-bool apply_brick_collision(struct ball *ball, struct vec2 *brick_position, float delta, struct pos2 *final_pos)
+// One allocation for every field of the pool, made by setDebris() in
+// instances that render so that spawning never allocates
+static bool ensure_particles(void)
 {
+    if (!particles.x && role != ROLE_SERVER)
+    {
+        float *fields = malloc(MAX_PARTICLES * (5 * sizeof(float) + sizeof(uint32_t)));
+        particles.x = fields;
+        particles.y = fields + MAX_PARTICLES;
+        particles.vx = fields + 2 * MAX_PARTICLES;
+        particles.vy = fields + 3 * MAX_PARTICLES;
+        particles.life = fields + 4 * MAX_PARTICLES;
+        particles.color = (uint32_t *)(fields + 5 * MAX_PARTICLES);
+        particles.count = 0;
+    }
+    return particles.x;
+}
 
-    const float r = ball->r;
-    struct vec2 *velocity = &ball->velocity;
-    const struct pos2 *pos = &ball->pos;
+// Every handle free, no slot in use
+static void reset_ball_pool(void)
+{
+    ball_pool.end = 0;
+    ball_pool.holes = 0;
+    ball_pool.free_handle = 0;
+    for (uint32_t i = 0; i < MAX_CHAMBER_BALLS; i++)
+    {
+        ball_pool.slot_of[i] = i + 1 < MAX_CHAMBER_BALLS ? i + 1 : NO_BALL_HANDLE;
+    }
+}
 
-    if (final_pos->x + r < brick_position->x || final_pos->x - r > brick_position->x + BRICK_WIDTH)
-        return false;
-    if (final_pos->y - r > brick_position->y || final_pos->y + r < brick_position->y - BRICK_HEIGHT)
-        return false;
+// Allocated once, at its full size, by the first power-up setting or save
+// that needs it. Also makes room for chamber balls in the save buffer
+static bool ensure_ball_pool(void)
+{
+    if (!ball_pool.balls)
+    {
+        ball_pool.balls = malloc(MAX_CHAMBER_BALLS * (sizeof(struct ball) + sizeof(float) + 2 * sizeof(uint32_t)));
+        if (!ball_pool.balls)
+            return false;
+        ball_pool.life = (float *)(ball_pool.balls + MAX_CHAMBER_BALLS);
+        ball_pool.handle_of = (uint32_t *)(ball_pool.life + MAX_CHAMBER_BALLS);
+        ball_pool.slot_of = ball_pool.handle_of + MAX_CHAMBER_BALLS;
+        reset_ball_pool();
+    }
+    if (save_data && save_capacity < MAX_SAVE_SIZE)
+    {
+        uint8_t *grown = malloc(MAX_SAVE_SIZE);
+        if (!grown)
+            return false;
+        mymemcpy(grown, save_data, save_capacity);
+        free(save_data);
+        save_data = grown;
+        save_capacity = MAX_SAVE_SIZE;
+    }
+    return true;
+}
 
-    // We have a collision !
-    // we now need to find the surface of the brick that was hit
-    bool collision = false;
-    if (pos->y - r > brick_position->y && final_pos->y - r <= brick_position->y) // top side hit
+// Move the live balls down over the holes, keeping their order
+static void compact_ball_pool(void)
+{
+    size_t end = 0;
+    for (size_t slot = 0; slot < ball_pool.end; slot++)
     {
-        velocity->y = -velocity->y;
-        collision = true;
+        const uint32_t handle = ball_pool.handle_of[slot];
+        if (handle == NO_BALL_HANDLE)
+            continue;
+        ball_pool.balls[end] = ball_pool.balls[slot];
+        ball_pool.life[end] = ball_pool.life[slot];
+        ball_pool.handle_of[end] = handle;
+        ball_pool.slot_of[handle] = end;
+        end++;
     }
-    else if (pos->y + r < brick_position->y - BRICK_HEIGHT && final_pos->y + r >= brick_position->y - BRICK_HEIGHT) // bottom side hit
+    ball_pool.end = end;
+    ball_pool.holes = 0;
+}
+
+// History of predicted steps, and the scratch balls replays run on
+static bool ensure_prediction(void)
+{
+    if (!predicted_steps && max_balls > 0)
     {
-        velocity->y = -velocity->y;
-        collision = true;
+        predicted_steps = malloc(PREDICTION_HISTORY * sizeof(PredictedStep) +
+                                 (PREDICTION_HISTORY + 1) * max_balls * sizeof(struct ball));
+        if (!predicted_steps)
+            return false;
+        predicted_balls = (struct ball *)(predicted_steps + PREDICTION_HISTORY);
+        replay_balls = predicted_balls + PREDICTION_HISTORY * max_balls;
+        predicted_head = 0;
+        predicted_tail = 0;
     }
-    if (pos->x + r < brick_position->x && final_pos->x + r >= brick_position->x) // left side hit
+    return predicted_steps;
+}
+
+static uint8_t *ensure_sprite_pixels(void)
+{
+    if (!sprite_cache.pixels && role != ROLE_SERVER && max_canvas_size > 0)
     {
-        velocity->x = -velocity->x;
-        collision = true;
+        sprite_cache.pixels = malloc(max_canvas_size * sizeof(uint32_t));
+        sprite_cache.valid = false;
     }
-    else if (pos->x - r > brick_position->x + BRICK_WIDTH && final_pos->x - r <= brick_position->x + BRICK_WIDTH) // right side hit
+    return sprite_cache.pixels;
+}
+
+#ifndef PHYSICS_FIXED
+// Scratch space of step_binned_balls(), for max_balls balls
+static bool ensure_binning(void)
+{
+    if (!binned_order && max_balls > 0)
     {
-        velocity->x = -velocity->x;
-        collision = true;
+        binned_order = malloc(max_balls * (sizeof(uint32_t) + sizeof(struct pos2) + sizeof(uint16_t)));
+        if (!binned_order)
+            return false;
+        binned_final = (struct pos2 *)(binned_order + max_balls);
+        binned_cell = (uint16_t *)(binned_final + max_balls);
     }
+    return binned_order;
+}
+#endif
 
-    return collision;
+static Telemetry *ensure_telemetry(void)
+{
+    if (!telemetry && role != ROLE_CLIENT)
+    {
+        telemetry = malloc(sizeof(Telemetry));
+        if (telemetry)
+            mymemset(telemetry, 0, sizeof(Telemetry));
+    }
+    return telemetry;
 }
 
-uint32_t rainbow_colors(size_t x, size_t y)
+static uint8_t *ensure_overlay_strip(void)
 {
-    // rainbow gradient on 12 bricks, format 0xaabbggrr
-    static const uint32_t colors[] = {
-        0xff2800ff,
-        0xff0048ff,
-        0xff00b9ff,
-        0xff00ffd2,
-        0xff00ff5b,
-        0xff15ff00,
-        0xff86ff00,
-        0xfffcff00,
-        0xffff8f00,
-        0xffff1d00,
-        0xffff005a,
-        0xffff00cc,
-        0xffbf00ff,
-    };
-    return colors[y % BRICK_ROWS];
+    if (!overlay_strip && role != ROLE_SERVER)
+    {
+        overlay_strip = malloc(OVERLAY_WIDTH * OVERLAY_HEIGHT * sizeof(uint32_t));
+    }
+    return overlay_strip;
 }
 
-uint32_t alternating_colors(size_t x, size_t y)
+// Both rings are only allocated once the host asks for one of them
+static void ensure_rings(void)
 {
-    return (x + y) % 2 == 0 ? 0xffff0000 : 0xff0000ff;
+    if (!command_ring)
+    {
+        command_ring = malloc(sizeof(CommandRing));
+        result_ring = malloc(sizeof(ResultRing));
+        mymemset(command_ring, 0, sizeof(CommandRing));
+        mymemset(result_ring, 0, sizeof(ResultRing));
+    }
 }
 
-uint32_t zebra_colors(size_t x, size_t y)
+/**
+ * How many bytes we should use from saveMemory(). Grows with the number of
+ * chamber balls, up to MAX_SAVE_SIZE. In SAVE_FORMAT_COMPACT, the size of what
+ * the last save() wrote, or before the first save() an upper bound for the
+ * current chamber balls
+ */
+size_t saveSize(void)
 {
-    return y % 2 == 0 ? 0xffffffff : 0xff000000;
+    if (save_format == SAVE_FORMAT_COMPACT)
+        return save_length ? save_length : MAX_SAVE_HEADER_SIZE + state->chamber_balls * sizeof(SavedBall);
+    return sizeof(SaveState) + state->chamber_balls * sizeof(SavedBall);
 }
 
-uint32_t sphere_colors(size_t x, size_t y)
+// LEB128: 7 bits per byte, least significant first, high bit set on all but
+// the last byte. Returns the number of bytes written
+static size_t put_varint(uint8_t *out, size_t value)
 {
-    const size_t radius = sqrt((x - BRICKS_PER_ROW / 2) * (x - BRICKS_PER_ROW / 2) + (y - BRICK_ROWS / 2) * (y - BRICK_ROWS / 2));
-    if (radius < 4)
+    size_t length = 0;
+    while (value >= 0x80)
     {
-        return 0xff0000ff;
+        out[length++] = (value & 0x7f) | 0x80;
+        value >>= 7;
     }
-    else if (radius < 5)
+    out[length++] = value;
+    return length;
+}
+
+// Returns the number of bytes read, 0 if in_size bytes hold no complete
+// varint
+static size_t get_varint(const uint8_t *in, size_t in_size, size_t *value)
+{
+    *value = 0;
+    for (size_t i = 0; i < in_size && i < MAX_VARINT_SIZE; i++)
     {
-        return 0xff000000;
+        *value |= (size_t)(in[i] & 0x7f) << (7 * i);
+        if (!(in[i] & 0x80))
+            return i + 1;
     }
-    else
+    return 0;
+}
+
+// Number of bytes equal to bits[begin] from begin on, a word at a time while
+// it can
+static size_t run_length(const uint8_t *bits, size_t begin, size_t bytes)
+{
+    size_t end = begin + 1;
+    if (end == bytes || bits[end] != bits[begin])
+        return 1;
+    const uint64_t repeated = bits[begin] * (uint64_t)0x0101010101010101;
+    uint64_t word;
+    while (end + sizeof(word) <= bytes)
     {
-        return 0xffffffff;
+        mymemcpy(&word, bits + end, sizeof(word));
+        if (word != repeated)
+            break;
+        end += sizeof(word);
     }
+    while (end < bytes && bits[end] == bits[begin])
+        end++;
+    return end - begin;
 }
 
-uint32_t france_colors(size_t x, size_t y)
+// Run-length encoding of a bitset of bytes bytes. Each run starts with a
+// varint of its length times two, plus one for a fill run: fill runs are
+// followed by the byte they repeat, literal runs by their bytes. A level is
+// mostly standing (0x00 bytes) or mostly destroyed (0xff), so bitsets tend to
+// be a few fill runs. At most MAX_ENCODED_BITS_SIZE(bytes) bytes are written,
+// returns how many
+static size_t encode_bits(uint8_t *out, const uint8_t *bits, size_t bytes)
 {
-    if (x < BRICKS_PER_ROW / 3)
+    size_t length = 0;
+    size_t literal = 0; // Start of the pending literal run
+    size_t i = 0;
+    while (i < bytes)
     {
-        return 0xffff0000;
+        const size_t run = run_length(bits, i, bytes);
+        if (run < MIN_FILL_RUN)
+        {
+            i += run;
+            continue;
+        }
+        if (literal < i)
+        {
+            length += put_varint(out + length, (i - literal) * 2);
+            mymemcpy(out + length, bits + literal, i - literal);
+            length += i - literal;
+        }
+        length += put_varint(out + length, run * 2 + 1);
+        out[length++] = bits[i];
+        i += run;
+        literal = i;
+        // Never worse than a single literal run: fall back to one as soon as
+        // the runs so far took more bytes than they cover
+        if (length > i)
+        {
+            literal = 0;
+            length = 0;
+            break;
+        }
     }
-    else if (x < 2 * BRICKS_PER_ROW / 3)
+    if (literal < bytes)
     {
-        return 0xffffffff;
+        length += put_varint(out + length, (bytes - literal) * 2);
+        mymemcpy(out + length, bits + literal, bytes - literal);
+        length += bytes - literal;
     }
-    else
+    return length;
+}
+
+// Inverse of encode_bits(), reading at most in_size bytes of in. Returns the
+// number of bytes read, 0 if they do not encode exactly bytes bytes
+static size_t decode_bits(uint8_t *bits, size_t bytes, const uint8_t *in, size_t in_size)
+{
+    size_t read = 0;
+    size_t written = 0;
+    while (written < bytes)
     {
-        return 0xff0000ff;
+        size_t token;
+        const size_t token_size = get_varint(in + read, in_size - read, &token);
+        if (token_size == 0)
+            return 0;
+        read += token_size;
+        const size_t run = token / 2;
+        if (run > bytes - written || (token & 1 ? 1 : run) > in_size - read)
+            return 0;
+        if (token & 1)
+            mymemset(bits + written, in[read++], run);
+        else
+        {
+            mymemcpy(bits + written, in + read, run);
+            read += run;
+        }
+        written += run;
     }
+    return read;
 }
 
-// array of color generation function pointers
-uint32_t (*brick_color_functions[])(size_t, size_t) = {
-    rainbow_colors,
-    alternating_colors,
-    zebra_colors,
-    sphere_colors,
-    france_colors};
+// SAVE_FORMAT_COMPACT: SAVE_COMPACT_TAG, the counters of the SaveState as
+// varints, its bricks through encode_bits(), zeros up to the alignment of
+// SavedBall, and the SavedBalls. Returns the number of bytes written
+static size_t save_compact(uint8_t *data)
+{
+    size_t length = 0;
+    data[length++] = SAVE_COMPACT_TAG;
+    length += put_varint(data + length, state->bricks_count);
+    length += put_varint(data + length, state->game_count);
+    length += put_varint(data + length, state->current_color_func);
+    length += put_varint(data + length, state->tick);
+    length += put_varint(data + length, state->chamber_balls);
+    length += encode_bits(data + length, state->brick_save, BRICK_SAVE_SIZE);
+    while (length % _Alignof(SavedBall))
+        data[length++] = 0;
+    return length;
+}
 
-#define COLOR_FUNC_COUNT (sizeof(brick_color_functions) / sizeof(brick_color_functions[0]))
+// Defined after the brick color functions, below
+static bool valid_color_func(size_t color_func);
 
-/**
- * Run physics and update chamber state
- *
- * This is typically run on the server, but in some contexts is also run on the
+// Decode a save_compact() header straight into the SaveState. Returns where
+// the SavedBalls start, 0 if data holds no compact save or counters out of
+// range, in which case the bricks may have been overwritten
+static size_t load_compact(const uint8_t *data)
+{
+    if (data[0] != SAVE_COMPACT_TAG)
+        return 0;
+    size_t counters[5];
+    size_t read = 1;
+    for (size_t i = 0; i < 5; i++)
+    {
+        const size_t size = get_varint(data + read, save_capacity - read, &counters[i]);
+        if (size == 0)
+            return 0;
+        read += size;
+    }
+    const size_t size = decode_bits(state->brick_save, BRICK_SAVE_SIZE, data + read, save_capacity - read);
+    if (size == 0)
+        return 0;
+    read += size;
+    if (counters[0] > BRICKS_PER_ROW * BRICK_ROWS || !valid_color_func(counters[2]) ||
+        counters[4] > MAX_CHAMBER_BALLS)
+        return 0;
+    state->bricks_count = counters[0];
+    state->game_count = counters[1];
+    state->current_color_func = counters[2];
+    state->tick = counters[3];
+    state->chamber_balls = counters[4];
+    return (read + _Alignof(SavedBall) - 1) / _Alignof(SavedBall) * _Alignof(SavedBall);
+}
+
+/**
+ * Since some code runs on the client, and some code runs on the server, we need
+ * a way to propagate our state from one side to the other. The save/load API is
+ * how we do this. Take any state from the physics side, serialize it,
+ * deserialize with load on the client side before render() is called
+ */
+void save(void)
+{
+    TRACE_SCOPE("save");
+    uint8_t *data = ensure_save_data();
+    size_t header_size = sizeof(SaveState);
+    if (save_format == SAVE_FORMAT_COMPACT)
+        header_size = save_compact(data);
+    else
+        mymemcpy(data, state, sizeof(SaveState));
+    save_length = header_size + state->chamber_balls * sizeof(SavedBall);
+    if (state->chamber_balls == 0)
+        return;
+    compact_ball_pool();
+    SavedBall *saved = (SavedBall *)(data + header_size);
+    for (size_t slot = 0; slot < ball_pool.end; slot++)
+    {
+        saved[slot] = (SavedBall){ball_pool.balls[slot], ball_pool.life[slot], ball_pool.handle_of[slot]};
+    }
+}
+
+// Defined with the rest of the debris code and step(), below
+static void spawn_destroyed_debris(const uint8_t *before, const uint8_t *after);
+static void replay_predicted_steps(void);
+
+// Put the chamber balls saved after the SaveState back in the same slots and
+// with the same handles, the remaining handles make up the free list. They
+// start at offset in save_data, which ensure_ball_pool() may move. A save
+// that does not fit in what the host could write, or with a handle out of
+// range or repeated, loads without chamber balls
+static void load_chamber_balls(size_t offset)
+{
+    if (state->chamber_balls == 0 && !ball_pool.balls)
+        return;
+    // Before ensure_ball_pool() grows the buffer the host wrote to
+    const size_t written = save_capacity;
+    if (state->chamber_balls > MAX_CHAMBER_BALLS || offset + state->chamber_balls * sizeof(SavedBall) > written ||
+        !ensure_ball_pool())
+    {
+        state->chamber_balls = 0;
+        if (ball_pool.balls)
+            reset_ball_pool();
+        return;
+    }
+    const SavedBall *saved = (const SavedBall *)(save_data + offset);
+
+    for (size_t i = 0; i < MAX_CHAMBER_BALLS; i++)
+    {
+        ball_pool.slot_of[i] = NO_BALL_HANDLE;
+    }
+    for (size_t slot = 0; slot < state->chamber_balls; slot++)
+    {
+        const uint32_t handle = saved[slot].handle;
+        if (handle >= MAX_CHAMBER_BALLS || ball_pool.slot_of[handle] != NO_BALL_HANDLE)
+        {
+            state->chamber_balls = 0;
+            reset_ball_pool();
+            return;
+        }
+        ball_pool.balls[slot] = saved[slot].ball;
+        ball_pool.life[slot] = saved[slot].life;
+        ball_pool.handle_of[slot] = handle;
+        ball_pool.slot_of[handle] = slot;
+    }
+    ball_pool.end = state->chamber_balls;
+    ball_pool.holes = 0;
+    ball_pool.free_handle = NO_BALL_HANDLE;
+    for (size_t i = MAX_CHAMBER_BALLS; i-- > 0;)
+    {
+        if (ball_pool.slot_of[i] == NO_BALL_HANDLE)
+        {
+            ball_pool.slot_of[i] = ball_pool.free_handle;
+            ball_pool.free_handle = i;
+        }
+    }
+}
+
+/**
+ * With prediction on (see setPrediction()), the loaded snapshot replaces the
+ * predicted state, and the steps predicted since its tick are run again on
+ * top of it
+ */
+void load(void)
+{
+    TRACE_SCOPE("load");
+    uint8_t shown[BRICK_SAVE_SIZE];
+    const size_t shown_game_count = state->game_count;
+    mymemcpy(shown, state->brick_save, BRICK_SAVE_SIZE);
+
+    size_t header_size = sizeof(SaveState);
+    if (save_format == SAVE_FORMAT_COMPACT)
+    {
+        header_size = load_compact(ensure_save_data());
+        if (header_size == 0)
+        {
+            mymemcpy(state->brick_save, shown, BRICK_SAVE_SIZE);
+            return;
+        }
+    }
+    else
+    {
+        mymemcpy(state, ensure_save_data(), sizeof(SaveState));
+    }
+    load_chamber_balls(header_size);
+    if (predicted_steps)
+        replay_predicted_steps();
+
+    // Bricks destroyed on the other side or in the replay, a new level has
+    // none
+    if (state->game_count == shown_game_count)
+        spawn_destroyed_debris(shown, state->brick_save);
+}
+
+Brick get_brick(SaveState *state, size_t x, size_t y)
+{
+    size_t brick_indice = x + y * BRICKS_PER_ROW;
+    size_t brick_save_indice = brick_indice / 8;
+    size_t brick_save_bit = (brick_indice % 8);
+
+    return (Brick){
+        state->brick_save[brick_save_indice] & (1 << brick_save_bit)};
+}
+
+// Can only set false to true, TODO fix
+void set_brick(SaveState *state, size_t x, size_t y, Brick brick)
+{
+    size_t brick_indice = x + y * BRICKS_PER_ROW;
+    size_t brick_save_indice = brick_indice / 8;
+    size_t brick_save_bit = (brick_indice % 8);
+
+    state->brick_save[brick_save_indice] |= (brick.destroyed ? 1 : 0) << brick_save_bit;
+}
+
+void reset_bricks(SaveState *state)
+{
+    // A cleared bit is a brick still standing
+    mymemset(state->brick_save, 0, BRICK_SAVE_SIZE);
+}
+
+static void compute_brick_geometry(void)
+{
+    for (size_t j = 0; j < BRICKS_PER_ROW; j++)
+    {
+        brick_left[j] = MARGIN_X + j * (BRICK_WIDTH + BRICK_GAP_X);
+    }
+    for (size_t i = 0; i < BRICK_ROWS; i++)
+    {
+        brick_top[i] = FIELD_HEIGHT - (MARGIN_Y + i * (BRICK_HEIGHT + BRICK_GAP_Y));
+    }
+#ifdef PHYSICS_FIXED
+    for (size_t j = 0; j < BRICKS_PER_ROW; j++)
+    {
+        fixed_brick_left[j] = FIXED_MARGIN_X + j * (FIXED_BRICK_WIDTH + FIXED_BRICK_GAP_X);
+    }
+    for (size_t i = 0; i < BRICK_ROWS; i++)
+    {
+        fixed_brick_top[i] = FIXED_FIELD_HEIGHT - (FIXED_MARGIN_Y + i * (FIXED_BRICK_HEIGHT + FIXED_BRICK_GAP_Y));
+    }
+#endif
+}
+
+// Start a new match in the buffers init() set up
+static void reset_match(void)
+{
+    state->bricks_count = BRICKS_PER_ROW * BRICK_ROWS;
+    state->current_color_func = 0;
+    state->game_count = 0;
+    reset_bricks(state);
+
+    game_count = 0;
+    seed = 12;
+    draw_list_count = 0;
+    particles.count = 0;
+    state->chamber_balls = 0;
+    state->tick = 0;
+    if (ball_pool.balls)
+        reset_ball_pool();
+    predicted_head = 0;
+    predicted_tail = 0;
+    if (telemetry)
+        mymemset(telemetry, 0, sizeof(Telemetry));
+    mymemset(&event_ring, 0, sizeof(event_ring));
+    if (command_ring)
+    {
+        mymemset(command_ring, 0, sizeof(CommandRing));
+        mymemset(result_ring, 0, sizeof(ResultRing));
+    }
+}
+
+/**
+ * Return every buffer owned by the chamber to walloc and forget the
+ * configuration passed to init(). The instance can then be handed to init()
+ * again, e.g. when a pooled module instance is reused for another match,
+ * without the wasm heap growing
+ */
+void deinit(void)
+{
+    free(balls_memory);
+    free(state);
+    free(save_data);
+    free(draw_list);
+    free(command_ring);
+    free(result_ring);
+    free(surfaces);
+    free(particles.x);
+    free(ball_pool.balls);
+    free(predicted_steps);
+    free(overlay_strip);
+    free(telemetry);
+    free(binned_order);
+    free(sprite_cache.pixels);
+    balls_memory = NULL;
+    state = NULL;
+    save_data = NULL;
+    save_capacity = 0;
+    draw_list = NULL;
+    draw_list_count = 0;
+    render_mode = RENDER_RASTER;
+    save_format = SAVE_FORMAT_RAW;
+    save_length = 0;
+    command_ring = NULL;
+    result_ring = NULL;
+    surfaces = NULL;
+    surface_nodes = NULL;
+    surface_order = NULL;
+    surface_count = 0;
+    surface_node_count = 0;
+    particles = (ParticlePool){0};
+    ball_pool = (BallPool){0};
+    power_ups = false;
+    predicted_steps = NULL;
+    predicted_balls = NULL;
+    replay_balls = NULL;
+    overlay_strip = NULL;
+    telemetry = NULL;
+    binned_order = NULL;
+    binned_cell = NULL;
+    binned_final = NULL;
+    brick_style = BRICK_STYLE_FLAT;
+    sprite_cache = (SpriteCache){0};
+    overlay_flags = 0;
+    overlay_stat = 0;
+    overlay_length = 0;
+    canvas_buffer_count = 1;
+    free_canvas_buffers();
+
+    role = ROLE_FULL;
+    pixel_format = PIXEL_FORMAT_RGBA8888;
+    max_balls = 0;
+    max_canvas_size = 0;
+    game_count = 0;
+    seed = 12;
+    mymemset(&event_ring, 0, sizeof(event_ring));
+}
+
+/**
+ * Called one time in both server and client contexts. max_num_balls or
+ * max_canvas_size may be 0, but in some contexts both will be set
+ *
+ * Use for one time initialization of chamber state. Only the SaveState and,
+ * unless this is a server, the particle pool are allocated here: balls, canvas
+ * and save buffers are allocated, sized exactly, the first time the matching
+ * xxxMemory() call (or step/render/save/load) needs them, so a server-only
+ * instance never pays for a canvas
+ *
+ * Calling init() again on a live instance with the same sizes keeps its
+ * buffers and render settings and only starts a new match. With different
+ * sizes the previous buffers are released first
+ */
+void init(size_t max_num_balls, size_t max_canvas)
+{
+    if (state && max_num_balls == max_balls && max_canvas == max_canvas_size)
+    {
+        // Typically an instance started from a pre-initialized snapshot, see
+        // wizer_initialize()
+        reset_match();
+        return;
+    }
+    if (state)
+        deinit();
+
+    compute_brick_geometry();
+    max_balls = max_num_balls;
+    max_canvas_size = max_canvas;
+    if (max_canvas == 0)
+        role = ROLE_SERVER;
+    else if (max_num_balls == 0)
+        role = ROLE_CLIENT;
+    else
+        role = ROLE_FULL;
+
+    state = malloc(sizeof(SaveState));
+    reset_match();
+}
+
+#ifndef SNAPSHOT_MAX_BALLS
+#define SNAPSHOT_MAX_BALLS 100
+#endif
+#ifndef SNAPSHOT_MAX_CANVAS_SIZE
+#define SNAPSHOT_MAX_CANVAS_SIZE 0
+#endif
+
+/**
+ * Build-time initializer for Wizer (https://github.com/bytecodealliance/wizer).
+ * Runs init() for the standard configuration, a server chamber unless
+ * SNAPSHOT_MAX_CANVAS_SIZE says otherwise, and allocates every buffer that
+ * configuration uses, so that the snapshot Wizer takes of the linear memory
+ * and globals already holds them. Instances of the snapshot then get through
+ * init() with the same sizes without a single walloc call
+ */
+__attribute__((export_name("wizer.initialize"))) void wizer_initialize(void)
+{
+    init(SNAPSHOT_MAX_BALLS, SNAPSHOT_MAX_CANVAS_SIZE);
+    ensure_balls_memory();
+    ensure_canvas_memory();
+    ensure_save_data();
+}
+
+/**
+ * Start a fresh match on an already initialized instance, possibly with a
+ * different configuration. Same as deinit() followed by init()
+ */
+void reinit(size_t max_num_balls, size_t max_canvas)
+{
+    deinit();
+    init(max_num_balls, max_canvas);
+}
+
+const struct vec2 NULL_VEC2 = {0};
+
+FLOAT_ONLY_BEGIN
+
+static void push_event(EventType type, size_t x, size_t y, uint32_t value, float time)
+{
+    if (replaying)
+        return;
+    const uint32_t head = event_ring.head;
+    if (head - __atomic_load_n(&event_ring.tail, __ATOMIC_ACQUIRE) == EVENT_RING_CAPACITY)
+    {
+        event_ring.dropped++;
+        return;
+    }
+    event_ring.entries[head % EVENT_RING_CAPACITY] = (Event){type, x, y, 0, value, time};
+    __atomic_store_n(&event_ring.head, head + 1, __ATOMIC_RELEASE);
+}
+
+#ifndef PHYSICS_FIXED
+// Time at which a ball travelling from pos to final_pos over delta seconds
+// first touches the brick, i.e. when it enters the brick grown by r on every
+// side
+static float brick_hit_time(const struct pos2 *pos, const struct pos2 *final_pos, float r,
+                            const struct vec2 *brick_position, float delta)
+{
+    float entry = 0.0f;
+    const float dx = final_pos->x - pos->x;
+    const float dy = final_pos->y - pos->y;
+    if (dx > 0.0f)
+        entry = fmaxf(entry, (brick_position->x - r - pos->x) / dx);
+    else if (dx < 0.0f)
+        entry = fmaxf(entry, (brick_position->x + BRICK_WIDTH + r - pos->x) / dx);
+    if (dy > 0.0f)
+        entry = fmaxf(entry, (brick_position->y - BRICK_HEIGHT - r - pos->y) / dy);
+    else if (dy < 0.0f)
+        entry = fmaxf(entry, (brick_position->y + r - pos->y) / dy);
+    return fminf(entry, 1.0f) * delta;
+}
+#endif
+
+bool apply_brick_collision(struct ball *ball, struct vec2 *brick_position, float delta, struct pos2 *final_pos)
+{
+
+    const float r = ball->r;
+    struct vec2 *velocity = &ball->velocity;
+    const struct pos2 *pos = &ball->pos;
+
+    if (final_pos->x + r < brick_position->x || final_pos->x - r > brick_position->x + BRICK_WIDTH)
+        return false;
+    if (final_pos->y - r > brick_position->y || final_pos->y + r < brick_position->y - BRICK_HEIGHT)
+        return false;
+
+    // We have a collision !
+    // we now need to find the surface of the brick that was hit
+    bool collision = false;
+    if (pos->y - r > brick_position->y && final_pos->y - r <= brick_position->y) // top side hit
+    {
+        velocity->y = -velocity->y;
+        collision = true;
+    }
+    else if (pos->y + r < brick_position->y - BRICK_HEIGHT && final_pos->y + r >= brick_position->y - BRICK_HEIGHT) // bottom side hit
+    {
+        velocity->y = -velocity->y;
+        collision = true;
+    }
+    if (pos->x + r < brick_position->x && final_pos->x + r >= brick_position->x) // left side hit
+    {
+        velocity->x = -velocity->x;
+        collision = true;
+    }
+    else if (pos->x - r > brick_position->x + BRICK_WIDTH && final_pos->x - r <= brick_position->x + BRICK_WIDTH) // right side hit
+    {
+        velocity->x = -velocity->x;
+        collision = true;
+    }
+
+    return collision;
+}
+
+// Grow a leaf to the surfaces it holds
+static void fit_surface_leaf(SurfaceNode *node)
+{
+    const struct surface *first = &surfaces[surface_order[node->first]].surface;
+    node->min_x = node->max_x = first->a.x;
+    node->min_y = node->max_y = first->a.y;
+    for (size_t i = node->first; i < node->first + node->count; i++)
+    {
+        const struct surface *surface = &surfaces[surface_order[i]].surface;
+        node->min_x = fminf(node->min_x, fminf(surface->a.x, surface->b.x));
+        node->min_y = fminf(node->min_y, fminf(surface->a.y, surface->b.y));
+        node->max_x = fmaxf(node->max_x, fmaxf(surface->a.x, surface->b.x));
+        node->max_y = fmaxf(node->max_y, fmaxf(surface->a.y, surface->b.y));
+    }
+}
+
+static void fit_surface_inner(SurfaceNode *node)
+{
+    const SurfaceNode *left = &surface_nodes[node->first];
+    const SurfaceNode *right = left + 1;
+    node->min_x = fminf(left->min_x, right->min_x);
+    node->min_y = fminf(left->min_y, right->min_y);
+    node->max_x = fmaxf(left->max_x, right->max_x);
+    node->max_y = fmaxf(left->max_y, right->max_y);
+}
+
+// Twice the center of a surface along one axis, only ever compared
+static float surface_center(size_t index, bool along_y)
+{
+    const struct surface *surface = &surfaces[index].surface;
+    return along_y ? surface->a.y + surface->b.y : surface->a.x + surface->b.x;
+}
+
+// Make node the root of a hierarchy over surface_order[begin, end): split the
+// surfaces in two halves along the longer side of their bounds until they fit
+// in a leaf. Children always come after their parent in surface_nodes
+static void build_surface_node(size_t node_index, size_t begin, size_t end)
+{
+    SurfaceNode *node = &surface_nodes[node_index];
+    node->first = begin;
+    node->count = end - begin;
+    fit_surface_leaf(node);
+    if (end - begin <= SURFACE_LEAF_SIZE)
+        return;
+
+    // Insertion sort, this only runs when the host sets new surfaces
+    const bool along_y = node->max_y - node->min_y > node->max_x - node->min_x;
+    for (size_t i = begin + 1; i < end; i++)
+    {
+        const uint16_t index = surface_order[i];
+        const float center = surface_center(index, along_y);
+        size_t j = i;
+        for (; j > begin && surface_center(surface_order[j - 1], along_y) > center; j--)
+        {
+            surface_order[j] = surface_order[j - 1];
+        }
+        surface_order[j] = index;
+    }
+
+    const size_t middle = begin + (end - begin) / 2;
+    node->first = surface_node_count;
+    node->count = 0;
+    surface_node_count += 2;
+    build_surface_node(node->first, begin, middle);
+    build_surface_node(node->first + 1, middle, end);
+}
+
+// Same resolution as the collisions of breakout nolimit.c: the point of the
+// ball closest to the surface is moved along the ball's path this step
+static bool apply_surface_collision(struct ball *ball, const ChamberSurface *surface, float delta)
+{
+    const struct vec2 normal = surface_normal(&surface->surface);
+    const struct vec2 corrected_velocity = vec2_mul(&ball->velocity, delta);
+    const struct vec2 offset = vec2_mul(&normal, -ball->r);
+    const struct pos2 contact = pos2_add(&ball->pos, &offset);
+    struct vec2 resolution;
+
+    if (!surface_collision_resolution(&surface->surface, &contact, &corrected_velocity, &resolution))
+        return false;
+    apply_ball_collision(ball, &resolution, &normal, &surface->velocity, delta, surface->elasticity);
+    return true;
+}
+
+// Bounce ball off the surfaces in its way this step, e.g. both walls of a
+// corner. Only leaves whose bounds meet the box around the ball's path are
+// tested, moving surfaces in them also push the ball out if they ran into it
+static void collide_surfaces(struct ball *ball, float delta)
+{
+    const float final_x = ball->pos.x + ball->velocity.x * delta;
+    const float final_y = ball->pos.y + ball->velocity.y * delta;
+    const float min_x = fminf(ball->pos.x, final_x) - ball->r;
+    const float min_y = fminf(ball->pos.y, final_y) - ball->r;
+    const float max_x = fmaxf(ball->pos.x, final_x) + ball->r;
+    const float max_y = fmaxf(ball->pos.y, final_y) + ball->r;
+
+    size_t stack[SURFACE_STACK_SIZE];
+    size_t stack_size = 0;
+    stack[stack_size++] = 0;
+    while (stack_size > 0)
+    {
+        const SurfaceNode *node = &surface_nodes[stack[--stack_size]];
+        if (node->min_x > max_x || node->max_x < min_x || node->min_y > max_y || node->max_y < min_y)
+            continue;
+        if (node->count == 0)
+        {
+            stack[stack_size++] = node->first;
+            stack[stack_size++] = node->first + 1;
+            continue;
+        }
+        for (size_t i = node->first; i < node->first + node->count; i++)
+        {
+            const ChamberSurface *surface = &surfaces[surface_order[i]];
+            if (surface->velocity.x != 0.0f || surface->velocity.y != 0.0f)
+                surface_push_if_colliding(&surface->surface, ball, &surface->velocity, delta, ball->r);
+            apply_surface_collision(ball, surface, delta);
+        }
+    }
+}
+
+FLOAT_ONLY_END
+
+// Every color the color functions below can return, format 0xaabbggrr. This
+// is the palette of PIXEL_FORMAT_INDEXED8 canvases, index 0 is the background
+static const uint32_t palette[] = {
+    0xffffffff,
+    0xff000000,
+    0xffff0000,
+    0xff0000ff,
+    // rainbow gradient on 12 bricks
+    0xff2800ff,
+    0xff0048ff,
+    0xff00b9ff,
+    0xff00ffd2,
+    0xff00ff5b,
+    0xff15ff00,
+    0xff86ff00,
+    0xfffcff00,
+    0xffff8f00,
+    0xffff1d00,
+    0xffff005a,
+    0xffff00cc,
+    0xffbf00ff,
+};
+
+#define PALETTE_SIZE (sizeof(palette) / sizeof(palette[0]))
+#define PALETTE_RAINBOW 4
+
+uint32_t rainbow_colors(size_t x, size_t y)
+{
+    return palette[PALETTE_RAINBOW + y % BRICK_ROWS];
+}
+
+uint32_t alternating_colors(size_t x, size_t y)
+{
+    return (x + y) % 2 == 0 ? 0xffff0000 : 0xff0000ff;
+}
+
+uint32_t zebra_colors(size_t x, size_t y)
+{
+    return y % 2 == 0 ? 0xffffffff : 0xff000000;
+}
+
+uint32_t sphere_colors(size_t x, size_t y)
+{
+    const size_t radius = sqrt((x - BRICKS_PER_ROW / 2) * (x - BRICKS_PER_ROW / 2) + (y - BRICK_ROWS / 2) * (y - BRICK_ROWS / 2));
+    if (radius < 4)
+    {
+        return 0xff0000ff;
+    }
+    else if (radius < 5)
+    {
+        return 0xff000000;
+    }
+    else
+    {
+        return 0xffffffff;
+    }
+}
+
+uint32_t france_colors(size_t x, size_t y)
+{
+    if (x < BRICKS_PER_ROW / 3)
+    {
+        return 0xffff0000;
+    }
+    else if (x < 2 * BRICKS_PER_ROW / 3)
+    {
+        return 0xffffffff;
+    }
+    else
+    {
+        return 0xff0000ff;
+    }
+}
+
+// array of color generation function pointers
+uint32_t (*brick_color_functions[])(size_t, size_t) = {
+    rainbow_colors,
+    alternating_colors,
+    zebra_colors,
+    sphere_colors,
+    france_colors};
+
+#define COLOR_FUNC_COUNT (sizeof(brick_color_functions) / sizeof(brick_color_functions[0]))
+
+static bool valid_color_func(size_t color_func)
+{
+    return color_func < COLOR_FUNC_COUNT;
+}
+
+uint32_t get_color_for_brick(size_t x, size_t y)
+{
+    return brick_color_functions[state->current_color_func](x, y);
+}
+
+FLOAT_ONLY_BEGIN
+
+// In [0, 1), from the chamber's generator
+static float particle_random(void)
+{
+    return (float)rand() / 32768.0f;
+}
+
+// Burst of debris over the rect of brick (x, y), in its color. Particles that
+// do not fit in the pool are dropped. Does nothing unless setDebris() is on
+static void spawn_debris(size_t x, size_t y)
+{
+    if (!particles.x || replaying)
+        return;
+    const uint32_t color = get_color_for_brick(x, y);
+    for (size_t i = 0; i < PARTICLES_PER_BRICK && particles.count < MAX_PARTICLES; i++)
+    {
+        const size_t p = particles.count++;
+        particles.x[p] = brick_left[x] + BRICK_WIDTH * particle_random();
+        particles.y[p] = brick_top[y] - BRICK_HEIGHT * particle_random();
+        particles.vx[p] = (particle_random() - 0.5f) * 0.6f;
+        particles.vy[p] = particle_random() * 0.4f;
+        particles.life[p] = PARTICLE_LIFETIME * (0.5f + 0.5f * particle_random());
+        particles.color[p] = color;
+    }
+}
+
+// Debris for every brick destroyed going from bricks before to bricks after,
+// both in the layout of SaveState.brick_save
+static void spawn_destroyed_debris(const uint8_t *before, const uint8_t *after)
+{
+    for (size_t i = 0; i < BRICK_SAVE_SIZE; i++)
+    {
+        uint8_t destroyed = after[i] & ~before[i];
+        while (destroyed)
+        {
+            const size_t brick_indice = i * 8 + __builtin_ctz(destroyed);
+            spawn_debris(brick_indice % BRICKS_PER_ROW, brick_indice / BRICKS_PER_ROW);
+            destroyed &= destroyed - 1;
+        }
+    }
+}
+
+static void update_particles(float delta)
+{
+    const size_t count = particles.count;
+    float *__restrict x = particles.x;
+    float *__restrict y = particles.y;
+    float *__restrict vx = particles.vx;
+    float *__restrict vy = particles.vy;
+    float *__restrict life = particles.life;
+    for (size_t i = 0; i < count; i++)
+    {
+        vy[i] -= PARTICLE_GRAVITY * delta;
+        x[i] += vx[i] * delta;
+        y[i] += vy[i] * delta;
+        life[i] -= delta;
+    }
+
+    for (size_t i = 0; i < particles.count;)
+    {
+        if (life[i] > 0.0f)
+        {
+            i++;
+            continue;
+        }
+        const size_t last = --particles.count;
+        x[i] = x[last];
+        y[i] = y[last];
+        vx[i] = vx[last];
+        vy[i] = vy[last];
+        life[i] = life[last];
+        particles.color[i] = particles.color[last];
+    }
+}
+
+/**
+ * Move ball by its velocity over delta seconds and bounce it off the walls of
+ * the chamber. The host does this for the balls in ballsMemory(), step() for
+ * chamber balls
+ */
+#ifdef PHYSICS_FIXED
+void move_ball(struct ball *ball, float delta)
+{
+    struct fixed_ball b = fixed_ball_from(ball);
+    const fixed fixed_delta = fixed_from_float(delta);
+    b.x += fixed_mul(b.vx, fixed_delta);
+    b.y += fixed_mul(b.vy, fixed_delta);
+    if (b.x < b.r)
+    {
+        b.x = b.r;
+        b.vx = fixed_abs(b.vx);
+    }
+    if (b.x > FIXED_ONE - b.r)
+    {
+        b.x = FIXED_ONE - b.r;
+        b.vx = -fixed_abs(b.vx);
+    }
+    if (b.y < b.r)
+    {
+        b.y = b.r;
+        b.vy = fixed_abs(b.vy);
+    }
+    if (b.y > FIXED_FIELD_HEIGHT - b.r)
+    {
+        b.y = FIXED_FIELD_HEIGHT - b.r;
+        b.vy = -fixed_abs(b.vy);
+    }
+    fixed_ball_store(&b, ball);
+}
+#else
+void move_ball(struct ball *ball, float delta)
+{
+    ball->pos.x = ball->pos.x + ball->velocity.x * delta;
+    ball->pos.y = ball->pos.y + ball->velocity.y * delta;
+    if (ball->pos.x < ball->r)
+    {
+        ball->pos.x = ball->r;
+        ball->velocity.x = __builtin_fabsf(ball->velocity.x);
+    }
+    if (ball->pos.x > 1.0f - ball->r)
+    {
+        ball->pos.x = 1.0f - ball->r;
+        ball->velocity.x = -__builtin_fabsf(ball->velocity.x);
+    }
+    if (ball->pos.y < ball->r)
+    {
+        ball->pos.y = ball->r;
+        ball->velocity.y = __builtin_fabsf(ball->velocity.y);
+    }
+    if (ball->pos.y > FIELD_HEIGHT - ball->r)
+    {
+        ball->pos.y = FIELD_HEIGHT - ball->r;
+        ball->velocity.y = -__builtin_fabsf(ball->velocity.y);
+    }
+}
+#endif
+
+// Same spread for every level, shifted by one brick per level
+static bool is_power_up(size_t x, size_t y)
+{
+    return (x * 5 + y * 3 + state->game_count) % POWER_UP_PERIOD == 0;
+}
+
+// Spawn POWER_UP_BALLS balls in the middle of brick (x, y), fanning out from
+// the velocity of the ball that destroyed it. Balls that do not fit in the
+// pool are dropped
+static void spawn_power_up_balls(const struct ball *ball, size_t x, size_t y)
+{
+    // A full array may still have holes, compacting it here would move the
+    // balls step_chamber_balls() is going through. It compacts a full array
+    // at the end of the step instead
+    for (size_t i = 0; i < POWER_UP_BALLS && ball_pool.free_handle != NO_BALL_HANDLE && ball_pool.end < MAX_CHAMBER_BALLS;
+         i++)
+    {
+        const uint32_t handle = ball_pool.free_handle;
+        const size_t slot = ball_pool.end++;
+        ball_pool.free_handle = ball_pool.slot_of[handle];
+        ball_pool.slot_of[handle] = slot;
+        ball_pool.handle_of[slot] = handle;
+        ball_pool.life[slot] = POWER_UP_BALL_LIFETIME;
+        ball_pool.balls[slot] = (struct ball){
+            {brick_left[x] + BRICK_WIDTH / 2.0f, brick_top[y] - BRICK_HEIGHT / 2.0f},
+            ball->r,
+            {ball->velocity.x + (i % 2 == 0 ? 0.5f : -0.5f) * (1 + i / 2), ball->velocity.y}};
+        state->chamber_balls++;
+    }
+}
+
+static void remove_chamber_ball(size_t slot)
+{
+    const uint32_t handle = ball_pool.handle_of[slot];
+    ball_pool.slot_of[handle] = ball_pool.free_handle;
+    ball_pool.free_handle = handle;
+    ball_pool.handle_of[slot] = NO_BALL_HANDLE;
+    ball_pool.balls[slot].r = 0.0f;
+    ball_pool.holes++;
+    state->chamber_balls--;
+}
+
+// What step_ball() reports of a ball step for telemetry: the cell its broad
+// phase was centred on and how many standing bricks it tested, as an index
+// into the flattened Telemetry::cell_tests
+static inline uint32_t ball_visit(size_t cell, size_t tests)
+{
+    return cell * (TELEMETRY_MAX_TESTS + 1) + tests;
+}
+
+// Where step_balls() counts the visits of this step, NULL when they are not
+// counted. Replayed steps were counted the first time
+static inline uint32_t *visit_counts(void)
+{
+    return telemetry && !replaying ? telemetry->cell_tests[0] : NULL;
+}
+
+static inline void count_brick_hit(size_t x, size_t y)
+{
+    if (telemetry && !replaying)
+        telemetry->brick_hits[x + y * BRICKS_PER_ROW]++;
+}
+
+#ifdef PHYSICS_FIXED
+// apply_brick_collision() on the Q16.16 grid
+static bool apply_fixed_brick_collision(struct fixed_ball *ball, fixed left, fixed top, fixed final_x, fixed final_y)
+{
+    const fixed r = ball->r;
+    if (final_x + r < left || final_x - r > left + FIXED_BRICK_WIDTH)
+        return false;
+    if (final_y - r > top || final_y + r < top - FIXED_BRICK_HEIGHT)
+        return false;
+
+    bool collision = false;
+    if (ball->y - r > top && final_y - r <= top) // top side hit
+    {
+        ball->vy = -ball->vy;
+        collision = true;
+    }
+    else if (ball->y + r < top - FIXED_BRICK_HEIGHT && final_y + r >= top - FIXED_BRICK_HEIGHT) // bottom side hit
+    {
+        ball->vy = -ball->vy;
+        collision = true;
+    }
+    if (ball->x + r < left && final_x + r >= left) // left side hit
+    {
+        ball->vx = -ball->vx;
+        collision = true;
+    }
+    else if (ball->x - r > left + FIXED_BRICK_WIDTH && final_x - r <= left + FIXED_BRICK_WIDTH) // right side hit
+    {
+        ball->vx = -ball->vx;
+        collision = true;
+    }
+    return collision;
+}
+
+// brick_hit_time() on the Q16.16 grid, as a fraction of the step
+static fixed fixed_brick_hit_time(const struct fixed_ball *ball, fixed final_x, fixed final_y, fixed left, fixed top)
+{
+    fixed entry = 0;
+    const fixed dx = final_x - ball->x;
+    const fixed dy = final_y - ball->y;
+    if (dx > 0)
+        entry = fixed_max(entry, fixed_div(left - ball->r - ball->x, dx));
+    else if (dx < 0)
+        entry = fixed_max(entry, fixed_div(left + FIXED_BRICK_WIDTH + ball->r - ball->x, dx));
+    if (dy > 0)
+        entry = fixed_max(entry, fixed_div(top - FIXED_BRICK_HEIGHT - ball->r - ball->y, dy));
+    else if (dy < 0)
+        entry = fixed_max(entry, fixed_div(top + ball->r - ball->y, dy));
+    return fixed_min(entry, FIXED_ONE);
+}
+
+// Fixed-point version of the step_ball() below, in the same order: gravity,
+// surfaces, then bricks. Surfaces go through libphysics in float, on the ball
+// stored back after gravity, and are not covered by the determinism of this
+// mode. Returns the ball_visit()
+static uint32_t step_ball(struct ball *ball, uint32_t index, float delta)
+{
+    struct fixed_ball b = fixed_ball_from(ball);
+    const fixed fixed_delta = fixed_from_float(delta);
+    b.vy -= fixed_mul(FIXED_GRAVITY, fixed_delta);
+    if (surface_node_count > 0)
+    {
+        fixed_ball_store(&b, ball);
+        collide_surfaces(ball, delta);
+        b = fixed_ball_from(ball);
+    }
+    const fixed final_x = b.x + fixed_mul(b.vx, fixed_delta);
+    const fixed final_y = b.y + fixed_mul(b.vy, fixed_delta);
+
+    int ball_brick_x = (final_x - FIXED_MARGIN_X) / (FIXED_BRICK_WIDTH + FIXED_BRICK_GAP_X);
+    ball_brick_x = ball_brick_x <= 0 ? 1 : ball_brick_x;
+    ball_brick_x = ball_brick_x >= BRICKS_PER_ROW - 1 ? BRICKS_PER_ROW - 2 : ball_brick_x;
+
+    int ball_brick_y = (FIXED_FIELD_HEIGHT - final_y - FIXED_MARGIN_Y) / (FIXED_BRICK_HEIGHT + FIXED_BRICK_GAP_Y);
+    ball_brick_y = ball_brick_y <= 0 ? 1 : ball_brick_y;
+    ball_brick_y = ball_brick_y >= BRICK_ROWS - 1 ? BRICK_ROWS - 2 : ball_brick_y;
+
+    size_t tests = 0;
+    for (size_t r = ball_brick_x - 1; r <= ball_brick_x + 1; r++)
+    {
+        for (size_t c = ball_brick_y - 1; c <= ball_brick_y + 1; c++)
+        {
+            Brick brick = get_brick(state, r, c);
+            if (brick.destroyed)
+                continue;
+
+            tests++;
+            const struct fixed_ball before = b;
+            if (apply_fixed_brick_collision(&b, fixed_brick_left[r], fixed_brick_top[c], final_x, final_y))
+            {
+                brick.destroyed = true;
+                set_brick(state, r, c, brick);
+                state->bricks_count--;
+                spawn_debris(r, c);
+                const fixed time = fixed_brick_hit_time(&before, final_x, final_y, fixed_brick_left[r], fixed_brick_top[c]);
+                push_event(EVENT_BRICK_DESTROYED, r, c, index, fixed_to_float(fixed_mul(time, fixed_delta)));
+                count_brick_hit(r, c);
+                fixed_ball_store(&b, ball);
+                if (power_ups && is_power_up(r, c))
+                    spawn_power_up_balls(ball, r, c);
+                return ball_visit(ball_brick_x + ball_brick_y * BRICKS_PER_ROW, tests);
+            }
+        }
+    }
+    fixed_ball_store(&b, ball);
+    return ball_visit(ball_brick_x + ball_brick_y * BRICKS_PER_ROW, tests);
+}
+#else
+// Gravity and surfaces, then where the ball ends up this step unless it hits
+// a brick
+static struct pos2 integrate_ball(struct ball *ball, float delta)
+{
+    apply_gravity(ball, delta);
+    if (surface_node_count > 0)
+        collide_surfaces(ball, delta);
+    struct vec2 corrected_velocity = vec2_mul(&ball->velocity, delta);
+    return pos2_add(&ball->pos, &corrected_velocity);
+}
+
+// Brick cell a ball ending up at final_pos tests the 3x3 bricks around, kept
+// off the edges of the grid
+static size_t ball_cell(const struct pos2 *final_pos)
+{
+    int ball_brick_x = (final_pos->x - MARGIN_X) / (BRICK_WIDTH + BRICK_GAP_X);
+    ball_brick_x = ball_brick_x <= 0 ? 1 : ball_brick_x;
+    ball_brick_x = ball_brick_x >= BRICKS_PER_ROW - 1 ? BRICKS_PER_ROW - 2 : ball_brick_x;
+
+    int ball_brick_y = (FIELD_HEIGHT - final_pos->y - MARGIN_Y) / (BRICK_HEIGHT + BRICK_GAP_Y);
+    ball_brick_y = ball_brick_y <= 0 ? 1 : ball_brick_y;
+    ball_brick_y = ball_brick_y >= BRICK_ROWS - 1 ? BRICK_ROWS - 2 : ball_brick_y;
+    return ball_brick_x + ball_brick_y * BRICKS_PER_ROW;
+}
+
+// Collide one ball with at most one of the bricks around cell. index
+// identifies the ball in events. Returns the ball_visit()
+static uint32_t collide_bricks(struct ball *ball, uint32_t index, float delta, size_t cell, struct pos2 final_pos)
+{
+    const size_t ball_brick_x = cell % BRICKS_PER_ROW;
+    const size_t ball_brick_y = cell / BRICKS_PER_ROW;
+
+    // only one collision per ball per step
+    size_t tests = 0;
+    for (size_t r = ball_brick_x - 1; r <= ball_brick_x + 1; r++)
+    {
+        for (size_t c = ball_brick_y - 1; c <= ball_brick_y + 1; c++)
+        {
+
+            Brick b = get_brick(state, r, c);
+
+            if (b.destroyed)
+                continue;
+
+            tests++;
+            struct vec2 brick_position = {brick_left[r], brick_top[c]};
+            if (apply_brick_collision(ball, &brick_position, delta, &final_pos))
+            {
+                b.destroyed = true;
+                set_brick(state, r, c, b);
+                state->bricks_count--;
+                spawn_debris(r, c);
+                push_event(EVENT_BRICK_DESTROYED, r, c, index,
+                           brick_hit_time(&ball->pos, &final_pos, ball->r, &brick_position, delta));
+                count_brick_hit(r, c);
+                if (power_ups && is_power_up(r, c))
+                    spawn_power_up_balls(ball, r, c);
+                return ball_visit(cell, tests);
+            }
+        }
+    }
+    return ball_visit(cell, tests);
+}
+
+// Collide one ball with the surfaces and at most one brick. index identifies
+// the ball in events. Returns the ball_visit()
+static uint32_t step_ball(struct ball *ball, uint32_t index, float delta)
+{
+    const struct pos2 final_pos = integrate_ball(ball, delta);
+    return collide_bricks(ball, index, delta, ball_cell(&final_pos), final_pos);
+}
+
+// Whether any brick of the 3x3 around cell is standing. Bricks only fall
+// during a step, so a cell without any stays that way until the level resets
+static bool cell_has_bricks(size_t cell)
+{
+    const size_t x = cell % BRICKS_PER_ROW;
+    const size_t y = cell / BRICKS_PER_ROW;
+    for (size_t r = x - 1; r <= x + 1; r++)
+    {
+        for (size_t c = y - 1; c <= y + 1; c++)
+        {
+            if (!get_brick(state, r, c).destroyed)
+                return true;
+        }
+    }
+    return false;
+}
+
+// step_ball() on every ball, in three passes: integrate all of them, counting
+// sort their indices by cell, then collide them with bricks one cell after the
+// other, skipping cells with nothing left around. Balls are updated where they
+// are, so the host sees them in its own order. Bricks two balls reach in the
+// same step go to the first ball in cell order rather than in index order
+static void step_binned_balls(struct ball *balls, size_t num_balls, float delta, uint32_t *counts)
+{
+    uint32_t starts[BRICKS_PER_ROW * BRICK_ROWS + 1] = {0};
+    {
+        TRACE_SCOPE("integration");
+        for (size_t i = 0; i < num_balls; i++)
+        {
+            binned_final[i] = integrate_ball(&balls[i], delta);
+            binned_cell[i] = ball_cell(&binned_final[i]);
+            starts[binned_cell[i] + 1]++;
+        }
+    }
+    {
+        TRACE_SCOPE("broad phase");
+        for (size_t cell = 0; cell < BRICKS_PER_ROW * BRICK_ROWS; cell++)
+        {
+            starts[cell + 1] += starts[cell];
+        }
+        uint32_t next[BRICKS_PER_ROW * BRICK_ROWS];
+        mymemcpy(next, starts, sizeof(next));
+        for (size_t i = 0; i < num_balls; i++)
+        {
+            binned_order[next[binned_cell[i]]++] = i;
+        }
+    }
+    TRACE_SCOPE("narrow phase");
+    for (size_t cell = 0; cell < BRICKS_PER_ROW * BRICK_ROWS; cell++)
+    {
+        if (starts[cell] == starts[cell + 1])
+            continue;
+        if (!cell_has_bricks(cell))
+        {
+            if (counts)
+                counts[ball_visit(cell, 0)] += starts[cell + 1] - starts[cell];
+            continue;
+        }
+        for (size_t i = starts[cell]; i < starts[cell + 1]; i++)
+        {
+            const uint32_t index = binned_order[i];
+            const uint32_t visit = collide_bricks(&balls[index], index, delta, cell, binned_final[index]);
+            if (counts)
+                counts[visit]++;
+        }
+    }
+}
+#endif
+
+// Step and move the chamber balls, then retire the expired ones. Balls
+// spawned during this step only start moving at the next one
+static void step_chamber_balls(size_t num_balls, float delta, uint32_t *counts)
+{
+    const size_t end = ball_pool.end;
+    for (size_t slot = 0; slot < end; slot++)
+    {
+        if (ball_pool.handle_of[slot] == NO_BALL_HANDLE)
+            continue;
+        const uint32_t visit = step_ball(&ball_pool.balls[slot], num_balls + ball_pool.handle_of[slot], delta);
+        if (counts)
+            counts[visit]++;
+        move_ball(&ball_pool.balls[slot], delta);
+        ball_pool.life[slot] -= delta;
+        if (ball_pool.life[slot] <= 0.0f)
+            remove_chamber_ball(slot);
+    }
+    // Keep the array step() walks dense once a quarter of it is holes, and
+    // make room for new balls as soon as it is full
+    if (ball_pool.holes * 4 > ball_pool.end || (ball_pool.end == MAX_CHAMBER_BALLS && ball_pool.holes > 0))
+        compact_ball_pool();
+}
+
+// step() on balls
+static void step_balls(struct ball *balls, size_t num_balls, float delta)
+{
+    uint32_t *counts = visit_counts();
+#ifndef PHYSICS_FIXED
+    if (binned_order)
+    {
+        step_binned_balls(balls, num_balls, delta, counts);
+    }
+    else
+#endif
+    {
+        TRACE_SCOPE("balls");
+        for (size_t i = 0; i < num_balls; i++)
+        {
+            const uint32_t visit = step_ball(&balls[i], i, delta);
+            if (counts)
+                counts[visit]++;
+        }
+    }
+    if (state->chamber_balls > 0)
+    {
+        TRACE_SCOPE("chamber balls");
+        step_chamber_balls(num_balls, delta, counts);
+    }
+    if (counts)
+    {
+        telemetry->steps++;
+        telemetry->level_steps++;
+        telemetry->level_time += delta;
+    }
+    if (state->bricks_count == 0)
+    {
+        TRACE_SCOPE("level reset");
+        if (telemetry && !replaying)
+        {
+            const size_t level = telemetry->levels++ % TELEMETRY_LEVELS;
+            telemetry->clear_steps[level] = telemetry->level_steps;
+            telemetry->clear_time[level] = telemetry->level_time;
+            telemetry->level_steps = 0;
+            telemetry->level_time = 0.0f;
+        }
+        reset_bricks(state);
+        state->bricks_count = BRICK_ROWS * BRICKS_PER_ROW;
+        state->current_color_func = (state->current_color_func + 1) % COLOR_FUNC_COUNT;
+        state->game_count++;
+        push_event(EVENT_LEVEL_CLEARED, 0, 0, state->game_count, delta);
+        push_event(EVENT_PALETTE_SWITCHED, 0, 0, state->current_color_func, delta);
+    }
+    state->tick++;
+}
+
+/**
+ * Run physics and update chamber state
+ *
+ * This is typically run on the server, but in some contexts is also run on the
  * client
  *
  * num balls tells us how many balls have been placed in ballsMemory() by the
  * caller (initialized in init). Delta is the amount of time passed in seconds
  * that we want to simulate in this step
  *
+ * Chamber balls (see setPowerUps()) are stepped after them, and moved by
+ * step() itself
+ *
+ * With prediction on (see setPrediction()), the balls and delta of every step
+ * are also kept for load() to replay
+ *
  * Definition of balls is provided by physics.h, or physics.zig
  */
 void step(size_t num_balls, float delta)
 {
-    struct surface surface = {{0, 0}, {0, 0}};
-    for (size_t i = 0; i < num_balls; i++)
+    TRACE_SCOPE("step");
+    if (num_balls > max_balls)
+        num_balls = max_balls;
+    struct ball *balls = ensure_balls_memory();
+    if (predicted_steps)
+    {
+        if (predicted_head - predicted_tail == PREDICTION_HISTORY)
+            predicted_tail++;
+        const size_t entry = predicted_head++ % PREDICTION_HISTORY;
+        predicted_steps[entry] = (PredictedStep){state->tick, num_balls, delta};
+        mymemcpy(predicted_balls + entry * max_balls, balls, num_balls * sizeof(struct ball));
+    }
+    step_balls(balls, num_balls, delta);
+}
+
+// Run the steps predicted since the tick of the state just loaded, on the
+// balls each of them started from. Events and debris are not repeated
+static void replay_predicted_steps(void)
+{
+    while (predicted_tail != predicted_head && predicted_steps[predicted_tail % PREDICTION_HISTORY].tick < state->tick)
+        predicted_tail++;
+    // Without the step right after the snapshot, the history is of no use
+    if (predicted_tail == predicted_head || predicted_steps[predicted_tail % PREDICTION_HISTORY].tick != state->tick)
+    {
+        predicted_tail = predicted_head;
+        return;
+    }
+
+    TRACE_SCOPE("replay");
+    replaying = true;
+    for (size_t i = predicted_tail; i != predicted_head; i++)
+    {
+        const size_t entry = i % PREDICTION_HISTORY;
+        const PredictedStep *predicted = &predicted_steps[entry];
+        mymemcpy(replay_balls, predicted_balls + entry * max_balls, predicted->num_balls * sizeof(struct ball));
+        step_balls(replay_balls, predicted->num_balls, predicted->delta);
+    }
+    replaying = false;
+}
+
+FLOAT_ONLY_END
+
+typedef struct
+{
+    size_t x;
+    size_t y;
+    size_t width;
+    size_t height;
+} Rect;
+
+// Pixel rect covered by brick (x, y) on a canvas_width * canvas_height canvas
+static Rect brick_rect(size_t x, size_t y, size_t canvas_width, size_t canvas_height)
+{
+    return (Rect){(MARGIN_X + x * (BRICK_WIDTH + BRICK_GAP_X)) * canvas_width,
+                  (MARGIN_Y + y * (BRICK_HEIGHT + BRICK_GAP_Y)) * canvas_height / 0.7,
+                  BRICK_WIDTH * canvas_width,
+                  BRICK_HEIGHT * canvas_height / 0.7};
+}
+
+// Turn a 0xaabbggrr color into a pixel of the current format
+static uint32_t encode_color(uint32_t color)
+{
+    switch (pixel_format)
+    {
+    case PIXEL_FORMAT_INDEXED8:
+        for (size_t i = 0; i < PALETTE_SIZE; i++)
+        {
+            if (palette[i] == color)
+                return i;
+        }
+        return 0;
+    case PIXEL_FORMAT_RGB565:
+    {
+        const uint32_t r = color & 0xff;
+        const uint32_t g = (color >> 8) & 0xff;
+        const uint32_t b = (color >> 16) & 0xff;
+        return ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+    }
+    default:
+        return color;
+    }
+}
+
+// Write count copies of pixel starting at pixel index offset
+static void fill_pixels(size_t offset, size_t count, uint32_t pixel)
+{
+    switch (pixel_format)
     {
-        struct ball *ball = &balls_memory[i];
-        apply_gravity(ball, delta);
-        struct vec2 corrected_velocity = vec2_mul(&ball->velocity, delta);
-        struct pos2 final_pos = pos2_add(&ball->pos, &corrected_velocity);
+    case PIXEL_FORMAT_INDEXED8:
+        mymemset(canvas_memory + offset, pixel, count);
+        break;
+    case PIXEL_FORMAT_RGB565:
+    {
+        uint16_t *row = (uint16_t *)canvas_memory + offset;
+        for (size_t j = 0; j < count; j++)
+        {
+            row[j] = pixel;
+        }
+        break;
+    }
+    default:
+    {
+        uint32_t *row = (uint32_t *)canvas_memory + offset;
+        for (size_t j = 0; j < count; j++)
+        {
+            row[j] = pixel;
+        }
+        break;
+    }
+    }
+}
+
+// Fill the part of rect that lies within rows [row_begin, row_end), color is
+// 0xaabbggrr whatever the pixel format
+void render_brick(Rect rect, size_t row_begin, size_t row_end, size_t canvas_width, uint32_t color)
+{
+    const size_t begin = rect.y > row_begin ? rect.y : row_begin;
+    const size_t end = rect.y + rect.height < row_end ? rect.y + rect.height : row_end;
+    const uint32_t pixel = encode_color(color);
+    for (size_t i = begin; i < end; i++)
+    {
+        fill_pixels(i * canvas_width + rect.x, rect.width, pixel);
+    }
+}
 
-        int ball_brick_x = (final_pos.x - MARGIN_X) / (BRICK_WIDTH + BRICK_GAP_X);
-        ball_brick_x = ball_brick_x <= 0 ? 1 : ball_brick_x;
-        ball_brick_x = ball_brick_x >= BRICKS_PER_ROW - 1 ? BRICKS_PER_ROW - 2 : ball_brick_x;
+// color moved towards white (light) or black. The palette has no shades, so
+// INDEXED8 canvases get flat sprites
+static uint32_t shade_color(uint32_t color, bool light)
+{
+    if (pixel_format == PIXEL_FORMAT_INDEXED8)
+        return color;
+    uint32_t shaded = color & 0xff000000;
+    for (size_t shift = 0; shift < 24; shift += 8)
+    {
+        const uint32_t channel = (color >> shift) & 0xff;
+        shaded |= (light ? channel + (255 - channel) / 2 : channel * 5 / 8) << shift;
+    }
+    return shaded;
+}
 
-        int ball_brick_y = (0.7 - final_pos.y - MARGIN_Y) / (BRICK_HEIGHT + BRICK_GAP_Y);
-        ball_brick_y = ball_brick_y <= 0 ? 1 : ball_brick_y;
-        ball_brick_y = ball_brick_y >= BRICK_ROWS - 1 ? BRICK_ROWS - 2 : ball_brick_y;
+// Rasterize one sprite of the cache, in brick_style
+static void render_sprite(size_t sprite)
+{
+    const size_t width = sprite_cache.width;
+    const size_t height = sprite_cache.height;
+    const uint32_t color = sprite_cache.colors[sprite];
+    const uint32_t pixel = encode_color(color);
+    const uint32_t light = encode_color(shade_color(color, true));
+    const uint32_t dark = encode_color(shade_color(color, false));
+    const size_t bevel = height / 6 > 0 ? height / 6 : 1;
 
-        bool collided = false; // only one collision per ball per step
-        for (size_t r = ball_brick_x - 1; r <= ball_brick_x + 1; r++)
+    uint8_t *canvas = canvas_memory;
+    canvas_memory = sprite_cache.pixels;
+    const size_t offset = sprite * width * height;
+    fill_pixels(offset, width * height, pixel);
+    if (brick_style == BRICK_STYLE_BEVEL)
+    {
+        // Lit edges win where the two meet, up to the diagonals of the
+        // corners
+        for (size_t y = 0; y < height; y++)
         {
-            for (size_t c = ball_brick_y - 1; c <= ball_brick_y + 1; c++)
+            for (size_t x = 0; x < width; x++)
             {
+                const bool lit = (y < bevel && x + y < width) || (x < bevel && x + y < height);
+                const bool shaded = x >= width - bevel || y >= height - bevel;
+                if (lit || shaded)
+                    fill_pixels(offset + y * width + x, 1, lit ? light : dark);
+            }
+        }
+    }
+    canvas_memory = canvas;
+}
+
+// Bring the sprite cache up to date for canvas_width * canvas_height, false
+// if bricks have to be filled instead
+static bool ensure_sprites(size_t canvas_width, size_t canvas_height)
+{
+    if (brick_style == BRICK_STYLE_FLAT || !ensure_sprite_pixels())
+        return false;
+    const Rect rect = brick_rect(0, 0, canvas_width, canvas_height);
+    if (sprite_cache.valid && sprite_cache.width == rect.width && sprite_cache.height == rect.height &&
+        sprite_cache.color_func == state->current_color_func && sprite_cache.format == pixel_format &&
+        sprite_cache.style == brick_style)
+        return true;
+    if (rect.width * rect.height * BRICKS_PER_ROW * BRICK_ROWS > max_canvas_size)
+        return false;
+
+    sprite_cache.width = rect.width;
+    sprite_cache.height = rect.height;
+    sprite_cache.color_func = state->current_color_func;
+    sprite_cache.format = pixel_format;
+    sprite_cache.style = brick_style;
+    sprite_cache.count = 0;
+    for (size_t brick = 0; brick < BRICKS_PER_ROW * BRICK_ROWS; brick++)
+    {
+        const uint32_t color = get_color_for_brick(brick % BRICKS_PER_ROW, brick / BRICKS_PER_ROW);
+        size_t sprite = 0;
+        while (sprite < sprite_cache.count && sprite_cache.colors[sprite] != color)
+            sprite++;
+        if (sprite == sprite_cache.count)
+        {
+            sprite_cache.colors[sprite_cache.count++] = color;
+            render_sprite(sprite);
+        }
+        sprite_cache.sprite_of[brick] = sprite;
+    }
+    sprite_cache.valid = true;
+    return true;
+}
+
+// render_brick() for the sprite of brick (x, y), one memcpy per row
+static void render_brick_sprite(Rect rect, size_t row_begin, size_t row_end, size_t canvas_width, size_t x, size_t y)
+{
+    const size_t begin = rect.y > row_begin ? rect.y : row_begin;
+    const size_t end = rect.y + rect.height < row_end ? rect.y + rect.height : row_end;
+    const size_t pixel_size = bytes_per_pixel();
+    const size_t row_size = sprite_cache.width * pixel_size;
+    const uint8_t *sprite = sprite_cache.pixels + sprite_cache.sprite_of[x + y * BRICKS_PER_ROW] * sprite_cache.height * row_size;
+    for (size_t i = begin; i < end; i++)
+    {
+        mymemcpy(canvas_memory + (i * canvas_width + rect.x) * pixel_size, sprite + (i - rect.y) * row_size, row_size);
+    }
+}
+
+// Render rows [row_begin, row_end) of the frame
+static void render_rows(size_t canvas_width, size_t canvas_height, size_t row_begin, size_t row_end)
+{
+    {
+        TRACE_SCOPE("clear");
+        // The background is white, which is all ones in the direct color
+        // formats and index 0 in the palette
+        mymemset(canvas_memory + row_begin * canvas_width * bytes_per_pixel(),
+                 pixel_format == PIXEL_FORMAT_INDEXED8 ? 0 : 0xff,
+                 (row_end - row_begin) * canvas_width * bytes_per_pixel());
+    }
+    TRACE_SCOPE("bricks");
+    for (size_t i = 0; i < BRICK_ROWS; i++)
+    {
+        for (size_t j = 0; j < BRICKS_PER_ROW; j++)
+        {
+            const Brick b = get_brick(state, j, i);
+            if (b.destroyed)
+                continue;
+            const Rect rect = brick_rect(j, i, canvas_width, canvas_height);
+            if (rect.y >= row_end || rect.y + rect.height <= row_begin)
+                continue;
+            if (sprite_cache.valid)
+                render_brick_sprite(rect, row_begin, row_end, canvas_width, j, i);
+            else
+                render_brick(rect, row_begin, row_end, canvas_width, get_color_for_brick(j, i));
+        }
+    }
+}
+
+// Bring a buffer that shows frame up to date by redrawing only the bricks
+// whose state changed since
+static void render_changed_bricks(const CanvasFrame *frame)
+{
+    TRACE_SCOPE("changed bricks");
+    for (size_t i = 0; i < BRICK_ROWS; i++)
+    {
+        for (size_t j = 0; j < BRICKS_PER_ROW; j++)
+        {
+            const size_t brick_indice = j + i * BRICKS_PER_ROW;
+            const uint8_t mask = 1 << (brick_indice % 8);
+            const bool destroyed = get_brick(state, j, i).destroyed;
+            const bool was_destroyed = frame->bricks[brick_indice / 8] & mask;
+            if (destroyed == was_destroyed)
+                continue;
+            const Rect rect = brick_rect(j, i, frame->width, frame->height);
+            if (!destroyed && sprite_cache.valid)
+                render_brick_sprite(rect, 0, frame->height, frame->width, j, i);
+            else
+                render_brick(rect, 0, frame->height, frame->width, destroyed ? 0xffffffff : get_color_for_brick(j, i));
+        }
+    }
+}
+
+// Pixel square of each particle that lies entirely within the canvas, over
+// whatever the canvas already shows
+static void render_particles(size_t canvas_width, size_t canvas_height)
+{
+    TRACE_SCOPE("particles");
+    if (particles.count == 0 || canvas_width < PARTICLE_SIZE || canvas_height < PARTICLE_SIZE)
+        return;
+    const float max_x = canvas_width - PARTICLE_SIZE;
+    const float max_y = canvas_height - PARTICLE_SIZE;
+    const float scale_y = canvas_height / FIELD_HEIGHT;
+    // Particles of a brick are next to each other, so this rarely misses
+    uint32_t color = particles.color[0];
+    uint32_t pixel = encode_color(color);
+    for (size_t i = 0; i < particles.count; i++)
+    {
+        const float px = particles.x[i] * canvas_width;
+        const float py = (FIELD_HEIGHT - particles.y[i]) * scale_y;
+        if (!(px >= 0.0f && px <= max_x && py >= 0.0f && py <= max_y))
+            continue;
+        if (particles.color[i] != color)
+        {
+            color = particles.color[i];
+            pixel = encode_color(color);
+        }
+        const size_t offset = (size_t)py * canvas_width + (size_t)px;
+        for (size_t row = 0; row < PARTICLE_SIZE; row++)
+        {
+            fill_pixels(offset + row * canvas_width, PARTICLE_SIZE, pixel);
+        }
+    }
+}
 
-                Brick b = get_brick(state, r, c);
+// 3x5 bitmap font, one bit per pixel, top left pixel in bit 14. Indexed by
+// character - ' ', characters without a glyph are blank
+static const uint16_t font[64] = {
+    ['0' - ' '] = 0x7b6f,
+    ['1' - ' '] = 0x2c97,
+    ['2' - ' '] = 0x73e7,
+    ['3' - ' '] = 0x73cf,
+    ['4' - ' '] = 0x5bc9,
+    ['5' - ' '] = 0x79cf,
+    ['6' - ' '] = 0x79ef,
+    ['7' - ' '] = 0x7249,
+    ['8' - ' '] = 0x7bef,
+    ['9' - ' '] = 0x7bcf,
+    ['C' - ' '] = 0x3923,
+    ['E' - ' '] = 0x79a7,
+    ['F' - ' '] = 0x79a4,
+    ['L' - ' '] = 0x4927,
+    ['O' - ' '] = 0x2b6a,
+    ['P' - ' '] = 0x6ba4,
+    ['R' - ' '] = 0x6bad,
+    ['S' - ' '] = 0x388e,
+    ['T' - ' '] = 0x7492,
+    ['U' - ' '] = 0x5b6f,
+    ['V' - ' '] = 0x5b6a,
+};
+
+// Decimal digits of number at out, without a terminating 0. Returns how many
+// were written, at most 20
+static size_t format_number(char *out, size_t number)
+{
+    char digits[20];
+    size_t count = 0;
+    do
+    {
+        digits[count++] = '0' + number % 10;
+        number /= 10;
+    } while (number > 0);
+    for (size_t i = 0; i < count; i++)
+    {
+        out[i] = digits[count - 1 - i];
+    }
+    return count;
+}
 
-                if (b.destroyed)
-                    continue;
+// Append "label number " to text if it fits, at its actual number of digits
+static size_t append_stat(char *text, size_t length, const char *label, size_t number)
+{
+    const size_t label_length = strlen(label);
+    char digits[20];
+    const size_t digit_count = format_number(digits, number);
+    if (length + label_length + digit_count + 2 > OVERLAY_MAX_CHARS)
+        return length;
+    mymemcpy(text + length, label, label_length);
+    length += label_length;
+    text[length++] = ' ';
+    mymemcpy(text + length, digits, digit_count);
+    length += digit_count;
+    text[length++] = ' ';
+    return length;
+}
 
-                if (apply_brick_collision(ball, &(struct vec2){MARGIN_X + r * (BRICK_WIDTH + BRICK_GAP_X), 0.7 - (MARGIN_Y + c * (BRICK_HEIGHT + BRICK_GAP_Y))},
-                                          delta, &final_pos))
-                {
-                    collided = true;
-                    b.destroyed = true;
-                    set_brick(state, r, c, b);
-                    state->bricks_count--;
-                    break;
-                }
+// Draw the glyphs of overlay_text into the strip, black on the white canvas
+// background
+static void render_overlay_strip(void)
+{
+    uint8_t *canvas = canvas_memory;
+    canvas_memory = overlay_strip;
+    const uint32_t background = encode_color(0xffffffff);
+    const uint32_t ink = encode_color(0xff000000);
+    fill_pixels(0, OVERLAY_WIDTH * OVERLAY_HEIGHT, background);
+    for (size_t i = 0; i < overlay_length; i++)
+    {
+        const uint8_t c = overlay_text[i] - ' ';
+        const uint16_t glyph = c < 64 ? font[c] : 0;
+        for (size_t bit = 0; bit < 15; bit++)
+        {
+            if (!(glyph & (1 << (14 - bit))))
+                continue;
+            const size_t x = (i * 4 + 1 + bit % 3) * OVERLAY_SCALE;
+            const size_t y = (1 + bit / 3) * OVERLAY_SCALE;
+            for (size_t row = 0; row < OVERLAY_SCALE; row++)
+            {
+                fill_pixels((y + row) * OVERLAY_WIDTH + x, OVERLAY_SCALE, ink);
             }
-            if (collided)
-                break;
         }
     }
-    if (state->bricks_count == 0)
+    canvas_memory = canvas;
+    overlay_strip_format = pixel_format;
+    overlay_version++;
+}
+
+// Compose the overlay text from the current state, and render it again only
+// if it changed
+static void update_overlay(void)
+{
+    if (!ensure_overlay_strip())
+        return;
+    char text[OVERLAY_MAX_CHARS];
+    size_t length = 0;
+    if (overlay_flags & OVERLAY_SCORE)
+        length = append_stat(text, length, "SCORE",
+                             state->game_count * BRICKS_PER_ROW * BRICK_ROWS + BRICKS_PER_ROW * BRICK_ROWS - state->bricks_count);
+    if (overlay_flags & OVERLAY_LEVEL)
+        length = append_stat(text, length, "LEVEL", state->game_count);
+    if (overlay_flags & OVERLAY_LEFT)
+        length = append_stat(text, length, "LEFT", state->bricks_count);
+    if (overlay_flags & OVERLAY_DEBUG)
+        length = append_stat(text, length, "STEP US", overlay_stat);
+
+    if (length == overlay_length && overlay_strip_format == pixel_format && overlay_version != 0)
+    {
+        bool same = true;
+        for (size_t i = 0; i < length; i++)
+        {
+            same &= text[i] == overlay_text[i];
+        }
+        if (same)
+            return;
+    }
+    mymemcpy(overlay_text, text, length);
+    overlay_length = length;
+    render_overlay_strip();
+}
+
+// Copy the strip to the bottom left corner of the canvas, one memcpy per row
+static void blit_overlay(size_t canvas_width, size_t canvas_height)
+{
+    TRACE_SCOPE("overlay");
+    if (canvas_width <= OVERLAY_MARGIN || canvas_height < OVERLAY_HEIGHT + OVERLAY_MARGIN)
+        return;
+    const size_t width = canvas_width - OVERLAY_MARGIN < OVERLAY_WIDTH ? canvas_width - OVERLAY_MARGIN : OVERLAY_WIDTH;
+    const size_t top = canvas_height - OVERLAY_HEIGHT - OVERLAY_MARGIN;
+    const size_t pixel_size = bytes_per_pixel();
+    for (size_t row = 0; row < OVERLAY_HEIGHT; row++)
+    {
+        mymemcpy(canvas_memory + ((top + row) * canvas_width + OVERLAY_MARGIN) * pixel_size,
+                 overlay_strip + row * OVERLAY_WIDTH * pixel_size, width * pixel_size);
+    }
+}
+
+#ifdef CHAMBER_THREADS
+// Tile-parallel rendering. The canvas is cut into horizontal tiles of
+// RENDER_TILE_ROWS rows that render() and the worker threads claim one at a
+// time. Natively the workers are pthreads render() starts on first use. In
+// wasm (shared memory, -matomics) the host spawns workers itself, each
+// calling renderWorker() once
+#define RENDER_TILE_ROWS 32
+#ifndef RENDER_THREADS
+#define RENDER_THREADS 4 // Native worker threads, render() itself also helps
+#endif
+
+typedef struct
+{
+    size_t canvas_width;
+    size_t canvas_height;
+    uint32_t tile_count;
+    // Generation of the frame in the high 16 bits, next unclaimed tile in the
+    // low ones, so that a worker running late can never claim a tile of a
+    // frame it has not seen
+    uint32_t claim;
+    uint32_t done_tiles;
+    int32_t generation; // Bumped for every frame, workers wait on it
+} RenderJob;
+
+static RenderJob render_job = {0};
+
+static bool claim_tile(uint32_t generation, uint32_t *tile)
+{
+    uint32_t claim = __atomic_load_n(&render_job.claim, __ATOMIC_ACQUIRE);
+    while ((claim >> 16) == (generation & 0xffff) && (claim & 0xffff) < render_job.tile_count)
+    {
+        if (__atomic_compare_exchange_n(&render_job.claim, &claim, claim + 1, true,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            *tile = claim & 0xffff;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void render_tiles(uint32_t generation)
+{
+    uint32_t tile;
+    while (claim_tile(generation, &tile))
+    {
+        TRACE_SCOPE("tile");
+        const size_t row_begin = tile * RENDER_TILE_ROWS;
+        const size_t row_end = row_begin + RENDER_TILE_ROWS < render_job.canvas_height
+                                   ? row_begin + RENDER_TILE_ROWS
+                                   : render_job.canvas_height;
+        render_rows(render_job.canvas_width, render_job.canvas_height, row_begin, row_end);
+        __atomic_add_fetch(&render_job.done_tiles, 1, __ATOMIC_RELEASE);
+    }
+}
+
+#ifdef __wasm__
+static void wait_for_frame(int32_t seen)
+{
+    __builtin_wasm_memory_atomic_wait32(&render_job.generation, seen, -1);
+}
+
+static void start_frame(void)
+{
+    __atomic_add_fetch(&render_job.generation, 1, __ATOMIC_RELEASE);
+    __builtin_wasm_memory_atomic_notify(&render_job.generation, -1);
+}
+
+static void ensure_render_workers(void)
+{
+}
+#else
+static pthread_mutex_t render_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t render_cond = PTHREAD_COND_INITIALIZER;
+static bool render_workers_started = false;
+
+static void wait_for_frame(int32_t seen)
+{
+    pthread_mutex_lock(&render_mutex);
+    while (__atomic_load_n(&render_job.generation, __ATOMIC_ACQUIRE) == seen)
+        pthread_cond_wait(&render_cond, &render_mutex);
+    pthread_mutex_unlock(&render_mutex);
+}
+
+static void start_frame(void)
+{
+    pthread_mutex_lock(&render_mutex);
+    __atomic_add_fetch(&render_job.generation, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&render_cond);
+    pthread_mutex_unlock(&render_mutex);
+}
+
+void renderWorker(void);
+
+static void *render_worker_main(void *arg)
+{
+    renderWorker();
+    return NULL;
+}
+
+static void ensure_render_workers(void)
+{
+    if (render_workers_started)
+        return;
+    render_workers_started = true;
+    for (size_t i = 0; i < RENDER_THREADS; i++)
+    {
+        pthread_t thread;
+        pthread_create(&thread, NULL, render_worker_main, NULL);
+        pthread_detach(thread);
+    }
+}
+#endif
+
+/**
+ * Body of a render worker thread, never returns. Helps render() with the
+ * tiles of every frame from now on
+ */
+void renderWorker(void)
+{
+    int32_t seen = __atomic_load_n(&render_job.generation, __ATOMIC_ACQUIRE);
+    for (;;)
     {
-        reset_bricks(state);
-        state->bricks_count = BRICK_ROWS * BRICKS_PER_ROW;
-        state->current_color_func = (state->current_color_func + 1) % COLOR_FUNC_COUNT;
-        state->game_count++;
+        wait_for_frame(seen);
+        seen = __atomic_load_n(&render_job.generation, __ATOMIC_ACQUIRE);
+        render_tiles(seen);
     }
 }
 
-uint32_t get_color_for_brick(size_t x, size_t y)
+static void render_parallel(size_t canvas_width, size_t canvas_height)
 {
-    return brick_color_functions[state->current_color_func](x, y);
+    ensure_render_workers();
+    const uint32_t generation = render_job.generation + 1;
+    render_job.canvas_width = canvas_width;
+    render_job.canvas_height = canvas_height;
+    render_job.tile_count = (canvas_height + RENDER_TILE_ROWS - 1) / RENDER_TILE_ROWS;
+    render_job.done_tiles = 0;
+    __atomic_store_n(&render_job.claim, (generation & 0xffff) << 16, __ATOMIC_RELEASE);
+    start_frame();
+
+    render_tiles(generation);
+    // Workers are finishing their last tiles, this is short
+    while (__atomic_load_n(&render_job.done_tiles, __ATOMIC_ACQUIRE) != render_job.tile_count)
+        ;
 }
+#endif
 
-void render_brick(size_t x, size_t y, size_t canvas_width, size_t width, size_t height, int32_t color)
+// RENDER_DRAW_LIST counterpart of render_rows() and render_particles(), using
+// the same brick rects
+static void render_draw_list(size_t canvas_width, size_t canvas_height)
 {
-    for (size_t i = 0; i < height; i++)
+    draw_list_count = 0;
+    draw_list[draw_list_count++] = (DrawRect){0, 0, canvas_width, canvas_height, 0xffffffff};
+    for (size_t i = 0; i < BRICK_ROWS; i++)
     {
-        for (size_t j = 0; j < width; j++)
+        for (size_t j = 0; j < BRICKS_PER_ROW; j++)
         {
-            canvas_memory[(y + i) * canvas_width + x + j] = color;
+            if (get_brick(state, j, i).destroyed)
+                continue;
+            const Rect rect = brick_rect(j, i, canvas_width, canvas_height);
+            draw_list[draw_list_count++] = (DrawRect){rect.x, rect.y, rect.width, rect.height,
+                                                      get_color_for_brick(j, i)};
         }
     }
+    // Same rejection as render_particles(), which also drops NaN positions
+    if (canvas_width < PARTICLE_SIZE || canvas_height < PARTICLE_SIZE)
+        return;
+    const float max_x = canvas_width - PARTICLE_SIZE;
+    const float max_y = canvas_height - PARTICLE_SIZE;
+    const float scale_y = canvas_height / FIELD_HEIGHT;
+    for (size_t i = 0; i < particles.count; i++)
+    {
+        const float px = particles.x[i] * canvas_width;
+        const float py = (FIELD_HEIGHT - particles.y[i]) * scale_y;
+        if (!(px >= 0.0f && px <= max_x && py >= 0.0f && py <= max_y))
+            continue;
+        draw_list[draw_list_count++] = (DrawRect){px, py, PARTICLE_SIZE, PARTICLE_SIZE, particles.color[i]};
+    }
 }
 
 /**
@@ -382,35 +2757,202 @@ void render_brick(size_t x, size_t y, size_t canvas_width, size_t width, size_t
  * Pixels are represented as 4 byte chunks of RGBA. Feel free to use a u32 with
  * 0xaabbggrr
  *
+ * Unless setPixelFormat() picked a compact format: 1 byte palette indices (see
+ * paletteMemory()) or 2 byte RGB565 pixels. Offsets into canvasMemory() are
+ * then scaled by 1 or 2 instead of 4
+ *
  * Note that canavs_width * canvas_height may be less than max_canvas_size, but
  * will never be greater
  *
  * canvasMemory() can be re-used between frames, so free to re-use previous
  * frame data if that is useful to you
+ *
+ * Each canvas buffer remembers what it shows, so unless the canvas size or the
+ * palette changed only the bricks that changed since are redrawn. With more
+ * than one buffer (see setCanvasBuffers()) this draws into a back buffer, and
+ * the frame only shows up in canvasMemory() after swapCanvas()
  */
 
-size_t game_count = 0;
 void render(size_t canvas_width, size_t canvas_height)
 {
-    mymemset(canvas_memory, 0xffffffff, canvas_width * canvas_height * sizeof(int32_t));
-    if (game_count != state->game_count)
+    TRACE_SCOPE("render");
+    if (render_mode == RENDER_DRAW_LIST)
     {
-        game_count = state->game_count;
+        if (ensure_draw_list())
+            render_draw_list(canvas_width, canvas_height);
+        return;
     }
-    for (size_t i = 0; i < BRICK_ROWS; i++)
+    if (!ensure_canvas_memory())
+        return;
+    game_count = state->game_count;
+    if (overlay_flags)
+        update_overlay();
+    // Before tiles are handed to the workers, which only read the cache
+    if (!ensure_sprites(canvas_width, canvas_height))
+        sprite_cache.valid = false;
+
+    canvas_memory = canvas_buffers[back_canvas];
+    CanvasFrame *frame = &canvas_frames[back_canvas];
+    // Debris moves every frame, redraw everything while there is some
+    const bool incremental = frame->valid && frame->width == canvas_width && frame->height == canvas_height &&
+                             frame->color_func == state->current_color_func && !frame->particles &&
+                             particles.count == 0;
+    if (incremental)
     {
-        for (size_t j = 0; j < BRICKS_PER_ROW; j++)
+        render_changed_bricks(frame);
+    }
+    else
+    {
+#ifdef CHAMBER_THREADS
+        render_parallel(canvas_width, canvas_height);
+#else
+        render_rows(canvas_width, canvas_height, 0, canvas_height);
+#endif
+        render_particles(canvas_width, canvas_height);
+    }
+    // The overlay sits below the bricks, it only needs drawing again when the
+    // text changed or the buffer was cleared
+    if (overlay_flags && overlay_strip && (!incremental || frame->overlay_version != overlay_version))
+        blit_overlay(canvas_width, canvas_height);
+    *frame = (CanvasFrame){true, canvas_width, canvas_height, state->current_color_func, particles.count > 0,
+                           overlay_version};
+    mymemcpy(frame->bricks, state->brick_save, BRICK_SAVE_SIZE);
+
+    // Publish the frame, and move on to a buffer that is neither shown nor
+    // waiting to be. With double buffering there is none, and the next frame
+    // replaces this one unless swapCanvas() is called first
+    ready_canvas = back_canvas;
+    for (size_t i = 0; i < canvas_buffer_count; i++)
+    {
+        if (i != front_canvas && i != ready_canvas)
         {
-            const Brick b = get_brick(state, j, i);
-            if (b.destroyed)
-                continue;
-            render_brick((MARGIN_X + j * (BRICK_WIDTH + BRICK_GAP_X)) * canvas_width,
-                         (MARGIN_Y + i * (BRICK_HEIGHT + BRICK_GAP_Y)) * canvas_height / 0.7,
-                         canvas_width,
-                         BRICK_WIDTH * canvas_width, BRICK_HEIGHT * canvas_height / 0.7,
-                         get_color_for_brick(j, i));
+            back_canvas = i;
+            break;
+        }
+    }
+}
+
+/**
+ * Show the latest frame completed by render(), and return the buffer that
+ * now holds it (also what canvasMemory() returns from now on). The host can
+ * keep reading it while the next frames are rendered into the other buffers
+ *
+ * Does nothing with a single buffer, where render() draws in place
+ */
+void *swapCanvas(void)
+{
+    if (!ensure_canvas_memory())
+        return NULL;
+    if (ready_canvas != NO_CANVAS && ready_canvas != front_canvas)
+    {
+        front_canvas = ready_canvas;
+        for (size_t i = 0; i < canvas_buffer_count; i++)
+        {
+            if (i != front_canvas)
+            {
+                back_canvas = i;
+                break;
+            }
+        }
+    }
+    ready_canvas = NO_CANVAS;
+    return canvas_buffers[front_canvas];
+}
+
+/**
+ * Choose between rasterizing frames (RENDER_RASTER, the default) and emitting
+ * them as a list of rectangles for the host to draw (RENDER_DRAW_LIST), see
+ * drawListMemory(). The canvas is not touched, nor allocated, in draw list
+ * mode
+ */
+void setRenderMode(size_t mode)
+{
+    render_mode = mode == RENDER_DRAW_LIST ? RENDER_DRAW_LIST : RENDER_RASTER;
+}
+
+/**
+ * Select the layout render() writes pixels in, see PixelFormat. Canvas buffers
+ * are reallocated at max_canvas_size times the new pixel size, so like
+ * setCanvasBuffers() this should be called before rendering starts
+ *
+ * Returns the number of bytes per pixel
+ */
+size_t setPixelFormat(size_t format)
+{
+    pixel_format = format <= PIXEL_FORMAT_RGB565 ? format : PIXEL_FORMAT_RGBA8888;
+    free_canvas_buffers();
+    return bytes_per_pixel();
+}
+
+/**
+ * Number of canvas buffers: 1 (the default) renders in place, 2 for double
+ * and 3 for triple buffering. Each buffer is max_canvas_size pixels.
+ * This drops the current buffers, so call it before rendering starts
+ *
+ * Returns the number of buffers actually used
+ */
+size_t setCanvasBuffers(size_t count)
+{
+    count = count == 0 ? 1 : count > MAX_CANVAS_BUFFERS ? MAX_CANVAS_BUFFERS : count;
+    canvas_buffer_count = count;
+    free_canvas_buffers();
+    return count;
+}
+
+/**
+ * Run every command the host queued in commandRingMemory(), in order, and
+ * write one CommandResult per command to resultRingMemory()
+ *
+ * This lets the host batch a frame's worth of step/render/save/load calls into
+ * a single call into the module. The host may keep producing commands while
+ * consuming results from a previous pump(). If the result ring fills up,
+ * pumping stops early and the remaining commands stay queued for the next
+ * call
+ *
+ * Returns the number of commands that were run
+ */
+size_t pump(void)
+{
+    ensure_rings();
+    const uint32_t head = __atomic_load_n(&command_ring->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = command_ring->tail;
+    uint32_t result_head = result_ring->head;
+    size_t executed = 0;
+
+    while (tail != head)
+    {
+        if (result_head - __atomic_load_n(&result_ring->tail, __ATOMIC_ACQUIRE) == RING_CAPACITY)
+            break;
+
+        const Command command = command_ring->entries[tail % RING_CAPACITY];
+        switch (command.type)
+        {
+        case COMMAND_STEP:
+            step(command.arg0, command.delta);
+            break;
+        case COMMAND_RENDER:
+            render(command.arg0, command.arg1);
+            break;
+        case COMMAND_SAVE:
+            save();
+            break;
+        case COMMAND_LOAD:
+            load();
+            break;
         }
+
+        result_ring->entries[result_head % RING_CAPACITY] = (CommandResult){
+            command.type, tail, state->bricks_count, state->game_count};
+        result_head++;
+        tail++;
+        executed++;
+
+        // Publish as we go so that the host can start consuming results (e.g.
+        // a rendered frame) while later commands run
+        __atomic_store_n(&result_ring->head, result_head, __ATOMIC_RELEASE);
+        __atomic_store_n(&command_ring->tail, tail, __ATOMIC_RELEASE);
     }
+    return executed;
 }
 
 /**
@@ -420,16 +2962,19 @@ void render(size_t canvas_width, size_t canvas_height)
  */
 void *ballsMemory(void)
 {
-    return balls_memory;
+    return ensure_balls_memory();
 }
 
 /**
  * Pointer to memory where the chamber will write pixels to. This needs
  * to be max_canvas_size * 4 bytes long. See render() for more info
+ *
+ * With several canvas buffers this is the front buffer, which changes on
+ * every swapCanvas()
  */
 void *canvasMemory(void)
 {
-    return canvas_memory;
+    return ensure_canvas_memory();
 }
 
 /**
@@ -438,9 +2983,440 @@ void *canvasMemory(void)
  *
  * This memory will not be used if saveSize() returns 0
  *
+ * It holds saveCapacity() bytes: a header until the chamber balls are
+ * allocated (setPowerUps(), or a load() with chamber balls), MAX_SAVE_SIZE
+ * from then on. The buffer moves when it grows, so get it again after those
+ * calls. A client loading saves with chamber balls should turn power-ups on
+ * first, so that they fit: saves that do not fit load without them
+ *
  * See save()/load() for more info
  */
 void *saveMemory(void)
 {
-    return save_data;
+    return ensure_save_data();
+}
+
+/**
+ * Bytes available at saveMemory(), see there
+ */
+size_t saveCapacity(void)
+{
+    ensure_save_data();
+    return save_capacity;
+}
+
+/**
+ * Pointer to the host -> chamber CommandRing. The host writes commands at
+ * entries[head % RING_CAPACITY] and then advances head, the chamber advances
+ * tail as pump() consumes them
+ */
+void *commandRingMemory(void)
+{
+    ensure_rings();
+    return command_ring;
+}
+
+/**
+ * Pointer to the chamber -> host ResultRing. The chamber writes results and
+ * advances head, the host advances tail once it has read them
+ */
+void *resultRingMemory(void)
+{
+    ensure_rings();
+    return result_ring;
+}
+
+/**
+ * Number of entries in each ring
+ */
+size_t ringCapacity(void)
+{
+    return RING_CAPACITY;
+}
+
+/**
+ * Pointer to the EventRing step() reports brick destructions and level resets
+ * to. The host reads entries between tail and head and then advances tail.
+ * dropped counts the events that did not fit since init()
+ */
+void *eventsMemory(void)
+{
+    return &event_ring;
+}
+
+/**
+ * Pointer to the 0xaabbggrr colors that PIXEL_FORMAT_INDEXED8 pixels index.
+ * The palette is constant, paletteSize() entries long
+ */
+void *paletteMemory(void)
+{
+    return (void *)palette;
+}
+
+size_t paletteSize(void)
+{
+    return PALETTE_SIZE;
+}
+
+/**
+ * Pointer to the DrawRects of the last frame rendered in RENDER_DRAW_LIST
+ * mode, drawListCount() of them, 12 bytes each. The first one clears the
+ * whole canvas
+ */
+void *drawListMemory(void)
+{
+    return ensure_draw_list();
+}
+
+size_t drawListCount(void)
+{
+    return draw_list_count;
+}
+
+/**
+ * Pointer to room for MAX_SURFACES (512) ChamberSurfaces, 28 bytes each. The
+ * host writes the walls, paddle and deflectors of the chamber there and then
+ * calls setSurfaces(). NULL on a client, which never steps its own balls
+ */
+void *surfacesMemory(void)
+{
+    return ensure_surfaces();
+}
+
+/**
+ * Make step() bounce balls off the first count surfaces of surfacesMemory(),
+ * and index them so that each ball is only tested against the few surfaces
+ * near its path. Returns how many surfaces were kept. Surfaces stay across
+ * init() with the same sizes, deinit() drops them
+ */
+size_t setSurfaces(size_t count)
+{
+    if (!ensure_surfaces())
+        return 0;
+    surface_count = count > MAX_SURFACES ? MAX_SURFACES : count;
+    surface_node_count = 0;
+    if (surface_count == 0)
+        return 0;
+    for (size_t i = 0; i < surface_count; i++)
+    {
+        surface_order[i] = i;
+    }
+    surface_node_count = 1;
+    build_surface_node(0, 0, surface_count);
+    return surface_count;
+}
+
+/**
+ * Call before step() once moving surfaces have been updated in
+ * surfacesMemory(). The hierarchy keeps its shape and only has its bounds
+ * recomputed, which stays cheap as long as surfaces move near where they were
+ * when setSurfaces() was called
+ */
+void refitSurfaces(void)
+{
+    for (size_t i = surface_node_count; i-- > 0;)
+    {
+        if (surface_nodes[i].count > 0)
+            fit_surface_leaf(&surface_nodes[i]);
+        else
+            fit_surface_inner(&surface_nodes[i]);
+    }
+}
+
+/**
+ * Move brick debris forward by delta seconds and drop the particles whose
+ * time is up. With setDebris() on, call this once per frame before render()
+ */
+void updateParticles(float delta)
+{
+    update_particles(delta);
+}
+
+/**
+ * Number of live debris particles
+ */
+size_t particleCount(void)
+{
+    return particles.count;
+}
+
+/**
+ * Turn brick debris on or off, off by default. With it, bricks destroyed by
+ * step() or found destroyed by load() burst into particles that render()
+ * draws, and that only age through updateParticles(): a host turning debris
+ * on must call it every frame. Debris also makes render() redraw the whole
+ * canvas while any is left. Returns whether debris is on, it stays off on a
+ * server and if the pool cannot be allocated
+ */
+size_t setDebris(size_t enabled)
+{
+    if (enabled && ensure_particles())
+        return 1;
+    free(particles.x);
+    particles = (ParticlePool){0};
+    return 0;
+}
+
+/**
+ * Turn power-up bricks on or off. Destroying one spawns POWER_UP_BALLS chamber
+ * balls that step() simulates for POWER_UP_BALL_LIFETIME seconds next to the
+ * host's balls. Returns whether power-ups are on, they stay off if the pool
+ * cannot be allocated
+ */
+size_t setPowerUps(size_t enabled)
+{
+    power_ups = enabled && ensure_ball_pool();
+    return power_ups;
+}
+
+/**
+ * Pointer to the chamber balls, chamberBallsEnd() slots of them. Slots with
+ * r == 0 are holes left by expired balls. Also filled in by load()
+ */
+void *chamberBallsMemory(void)
+{
+    return ball_pool.balls;
+}
+
+size_t chamberBallsEnd(void)
+{
+    return ball_pool.end;
+}
+
+/**
+ * Slot currently holding the chamber ball with this handle (its index in
+ * EVENT_BRICK_DESTROYED events minus num_balls), or -1 if it expired. Slots
+ * change when the pool is compacted, handles do not
+ */
+int32_t chamberBallSlot(uint32_t handle)
+{
+    if (!ball_pool.balls || handle >= MAX_CHAMBER_BALLS)
+        return -1;
+    const uint32_t slot = ball_pool.slot_of[handle];
+    if (slot >= ball_pool.end || ball_pool.handle_of[slot] != handle)
+        return -1;
+    return slot;
+}
+
+/**
+ * Turn client-side prediction on or off. A predicting client runs step() on
+ * its own balls between snapshots instead of waiting for load(), so bricks
+ * break as soon as a ball reaches them. Each snapshot it loads then replaces
+ * the predicted state, and the steps the client ran since the snapshot's tick
+ * are replayed on top of it, from the balls recorded for each of them
+ *
+ * Ticks count step() calls on either side, so the client must step when the
+ * server does, with the same delta. Up to PREDICTION_HISTORY steps can be
+ * replayed; a snapshot older than that is taken as is. Needs balls, i.e. a
+ * max_num_balls passed to init(). Returns whether prediction is on
+ */
+size_t setPrediction(size_t enabled)
+{
+    if (enabled && ensure_prediction())
+        return 1;
+    free(predicted_steps);
+    predicted_steps = NULL;
+    predicted_balls = NULL;
+    replay_balls = NULL;
+    return 0;
+}
+
+/**
+ * Number of step() calls the current state is the result of, same as the tick
+ * field of the SaveState in saveMemory()
+ */
+size_t currentTick(void)
+{
+    return state->tick;
+}
+
+// FNV-1a over the bytes of word, least significant first
+static uint32_t hash_word(uint32_t hash, uint32_t word)
+{
+    for (size_t i = 0; i < 4; i++)
+    {
+        hash = (hash ^ ((word >> (i * 8)) & 0xff)) * 16777619;
+    }
+    return hash;
+}
+
+static uint32_t hash_float(uint32_t hash, float value)
+{
+    uint32_t word;
+    mymemcpy(&word, &value, sizeof(word));
+    return hash_word(hash, word);
+}
+
+static uint32_t hash_ball(uint32_t hash, const struct ball *ball)
+{
+    hash = hash_float(hash, ball->pos.x);
+    hash = hash_float(hash, ball->pos.y);
+    hash = hash_float(hash, ball->r);
+    hash = hash_float(hash, ball->velocity.x);
+    return hash_float(hash, ball->velocity.y);
+}
+
+/**
+ * Hash of the chamber state, of the first num_balls balls in ballsMemory() and
+ * of the chamber balls. Padding and the width of size_t do not enter it, so
+ * native and wasm chambers that went through the same calls can compare
+ * hashes. With -DPHYSICS_FIXED they match whatever the compiler flags, see
+ * tools/determinism.c
+ */
+uint32_t stateHash(size_t num_balls)
+{
+    uint32_t hash = 2166136261u;
+    hash = hash_word(hash, state->bricks_count);
+    hash = hash_word(hash, state->game_count);
+    hash = hash_word(hash, state->current_color_func);
+    hash = hash_word(hash, state->chamber_balls);
+    hash = hash_word(hash, state->tick);
+    for (size_t i = 0; i < BRICK_SAVE_SIZE; i++)
+    {
+        hash = hash_word(hash, state->brick_save[i]);
+    }
+    const struct ball *balls = ensure_balls_memory();
+    for (size_t i = 0; i < num_balls && i < max_balls; i++)
+    {
+        hash = hash_ball(hash, &balls[i]);
+    }
+    for (size_t slot = 0; slot < ball_pool.end; slot++)
+    {
+        if (ball_pool.handle_of[slot] == NO_BALL_HANDLE)
+            continue;
+        hash = hash_word(hash, ball_pool.handle_of[slot]);
+        hash = hash_ball(hash, &ball_pool.balls[slot]);
+        hash = hash_float(hash, ball_pool.life[slot]);
+    }
+    return hash;
+}
+
+/**
+ * Draw a line of text over the bottom left corner of the canvas. flags picks
+ * what it shows, OR-ed OverlayFlag values: score, level, bricks left and the
+ * debug value of setOverlayStat(). 0 turns the overlay off. Not part of draw
+ * lists
+ */
+void setOverlay(size_t flags)
+{
+    overlay_flags = flags;
+    overlay_version++;
+    // Buffers showing the previous overlay have to be cleared
+    for (size_t i = 0; i < MAX_CANVAS_BUFFERS; i++)
+    {
+        canvas_frames[i].valid = false;
+    }
+}
+
+/**
+ * Value shown by OVERLAY_DEBUG, e.g. the step time in microseconds as
+ * measured by the host
+ */
+void setOverlayStat(size_t value)
+{
+    overlay_stat = value;
+}
+
+/**
+ * Turn collision telemetry on or off, see Telemetry. Turning it on while it
+ * already is starts the counters over. Steps replayed by prediction are not
+ * counted again. Stays off on a client. Returns whether telemetry is on
+ */
+size_t setTelemetry(size_t enabled)
+{
+    if (enabled && telemetry)
+    {
+        mymemset(telemetry, 0, sizeof(Telemetry));
+        return 1;
+    }
+    if (enabled && ensure_telemetry())
+        return 1;
+    free(telemetry);
+    telemetry = NULL;
+    return 0;
+}
+
+/**
+ * The Telemetry counters, NULL while setTelemetry() is off
+ */
+void *telemetryMemory(void)
+{
+    return telemetry;
+}
+
+size_t telemetrySize(void)
+{
+    return sizeof(Telemetry);
+}
+
+/**
+ * Draw bricks in style, a BrickStyle: flat (the default) or bevelled. Styles
+ * other than flat are drawn from pre-rendered sprites (see SpriteCache), which
+ * take one canvas buffer worth of memory, so they cost about as much as flat
+ * bricks. Draw lists always carry flat bricks. Returns the style in effect
+ */
+size_t setBrickStyle(size_t style)
+{
+    brick_style = style <= BRICK_STYLE_BEVEL ? style : BRICK_STYLE_FLAT;
+    if (brick_style == BRICK_STYLE_FLAT)
+    {
+        free(sprite_cache.pixels);
+        sprite_cache = (SpriteCache){0};
+    }
+    else if (!ensure_sprite_pixels())
+    {
+        brick_style = BRICK_STYLE_FLAT;
+    }
+    sprite_cache.valid = false;
+    for (size_t i = 0; i < MAX_CANVAS_BUFFERS; i++)
+    {
+        canvas_frames[i].valid = false;
+    }
+    return brick_style;
+}
+
+/**
+ * Pick the layout of saveMemory(), a SaveFormat. SAVE_FORMAT_RAW (the
+ * default) copies the SaveState as is. SAVE_FORMAT_COMPACT writes its
+ * counters as varints and run-length encodes the bricks, which are mostly
+ * all standing or all destroyed: a 108 brick level takes under 10 bytes
+ * instead of sizeof(SaveState). saveSize() then changes with every save().
+ * Both sides must use the same format. A compact load() leaves the state
+ * alone if saveMemory() holds no valid compact save, a raw one cannot tell.
+ * Returns the format in effect
+ */
+size_t setSaveFormat(size_t format)
+{
+    const SaveFormat previous = save_format;
+    save_format = format == SAVE_FORMAT_COMPACT ? SAVE_FORMAT_COMPACT : SAVE_FORMAT_RAW;
+    // The last save() was in the other format
+    if (save_format != previous)
+        save_length = 0;
+    return save_format;
+}
+
+/**
+ * Turn cell binning of the balls in ballsMemory() on or off. With it, step()
+ * first moves every ball through gravity and surfaces, then sorts them by the
+ * brick cell they end up in and collides them with bricks a cell at a time,
+ * skipping cells with no brick left around them. Neighbouring balls then
+ * share the bricks they look at, and balls away from any brick cost no brick
+ * tests at all. Balls stay where the host put them
+ *
+ * Bricks two balls reach in the same step can go to a different ball than
+ * without binning, so both sides of a predicting client must agree on it.
+ * Chamber balls are not binned. Needs balls, i.e. a max_num_balls passed to
+ * init(), and the float physics. Returns whether binning is on
+ */
+size_t setBallBinning(size_t enabled)
+{
+#ifndef PHYSICS_FIXED
+    if (enabled && ensure_binning())
+        return 1;
+#endif
+    free(binned_order);
+    binned_order = NULL;
+    binned_cell = NULL;
+    binned_final = NULL;
+    return 0;
 }
@@ -0,0 +1,99 @@
+// Q16.16 fixed-point ball math, used by step() in -DPHYSICS_FIXED builds
+//
+// Float results depend on compiler flags (contraction into fused
+// multiply-adds, fast-math) and on which libphysics build is linked, so two
+// chambers fed the same inputs can drift apart. Integer math does not: with
+// PHYSICS_FIXED, a native and a wasm chamber step balls to the same bits, and
+// peers can exchange inputs instead of state.
+//
+// Balls still cross the ABI as struct ball. step() converts them to struct
+// fixed_ball on the way in and back on the way out. Both conversions only
+// scale by a power of two, so they give the same bits everywhere, and a value
+// on the Q16.16 grid below 256 in magnitude survives the round trip exactly.
+
+#ifndef PHYSICS_FIXED_H
+#define PHYSICS_FIXED_H
+
+#include <stdint.h>
+
+// Needs struct ball: include after physics.h, which has no include guard
+
+typedef int32_t fixed;
+
+#define FIXED_SHIFT 16
+#define FIXED_ONE (1 << FIXED_SHIFT)
+
+// Constant expressions only (rounded at compile time)
+#define FIXED_CONST(x) ((fixed)((x) * FIXED_ONE + ((x) >= 0 ? 0.5 : -0.5)))
+
+// Same gravity as libphysics
+#define FIXED_GRAVITY FIXED_CONST(9.832)
+
+// A ball in chamber units, each field in Q16.16
+struct fixed_ball
+{
+    fixed x;
+    fixed y;
+    fixed r;
+    fixed vx;
+    fixed vy;
+};
+
+// Truncates towards zero, saturating outside of the Q16.16 range
+static inline fixed fixed_from_float(float x)
+{
+    const float scaled = x * (float)FIXED_ONE;
+    if (scaled >= 2147483520.0f)
+        return INT32_MAX;
+    if (scaled <= -2147483648.0f)
+        return INT32_MIN;
+    return (fixed)scaled;
+}
+
+static inline float fixed_to_float(fixed x)
+{
+    return (float)x / (float)FIXED_ONE;
+}
+
+static inline fixed fixed_mul(fixed a, fixed b)
+{
+    return (fixed)(((int64_t)a * b) >> FIXED_SHIFT);
+}
+
+// b must not be 0
+static inline fixed fixed_div(fixed a, fixed b)
+{
+    return (fixed)(((int64_t)a * FIXED_ONE) / b);
+}
+
+static inline fixed fixed_abs(fixed x)
+{
+    return x < 0 ? -x : x;
+}
+
+static inline fixed fixed_min(fixed a, fixed b)
+{
+    return a < b ? a : b;
+}
+
+static inline fixed fixed_max(fixed a, fixed b)
+{
+    return a > b ? a : b;
+}
+
+static inline struct fixed_ball fixed_ball_from(const struct ball *ball)
+{
+    return (struct fixed_ball){fixed_from_float(ball->pos.x), fixed_from_float(ball->pos.y), fixed_from_float(ball->r),
+                               fixed_from_float(ball->velocity.x), fixed_from_float(ball->velocity.y)};
+}
+
+static inline void fixed_ball_store(const struct fixed_ball *fixed_ball, struct ball *ball)
+{
+    ball->pos.x = fixed_to_float(fixed_ball->x);
+    ball->pos.y = fixed_to_float(fixed_ball->y);
+    ball->r = fixed_to_float(fixed_ball->r);
+    ball->velocity.x = fixed_to_float(fixed_ball->vx);
+    ball->velocity.y = fixed_to_float(fixed_ball->vy);
+}
+
+#endif
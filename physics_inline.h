@@ -0,0 +1,93 @@
+// Header-only versions of the vector math declared in physics.h
+//
+// Calls into libphysics cannot be inlined, and every argument goes through a
+// pointer. Building with -DPHYSICS_INLINE makes breakout.c include this header
+// instead of physics.h: the math below is then visible to the compiler, which
+// can inline it into the per-ball loop of step(). Everything is float only.
+// For both builds to produce the same bits, the operations must stay in the
+// same order as in libphysics.
+//
+// Collision resolution (surface_collision_resolution, apply_ball_collision,
+// ...) is not duplicated here and still comes from libphysics.
+
+#ifndef PHYSICS_INLINE_H
+#define PHYSICS_INLINE_H
+
+#include "./physics.h"
+
+// Must match the gravity libphysics applies in apply_gravity()
+#ifndef PHYSICS_GRAVITY
+#define PHYSICS_GRAVITY 9.832f
+#endif
+
+static inline struct pos2 inline_pos2_add(const struct pos2 *p, const struct vec2 *v)
+{
+    return (struct pos2){p->x + v->x, p->y + v->y};
+}
+
+static inline struct vec2 inline_pos2_sub(const struct pos2 *a, const struct pos2 *b)
+{
+    return (struct vec2){a->x - b->x, a->y - b->y};
+}
+
+static inline float inline_vec2_length_2(const struct vec2 *v)
+{
+    return v->x * v->x + v->y * v->y;
+}
+
+static inline float inline_vec2_length(const struct vec2 *v)
+{
+    return __builtin_sqrtf(inline_vec2_length_2(v));
+}
+
+static inline struct vec2 inline_vec2_add(const struct vec2 *a, const struct vec2 *b)
+{
+    return (struct vec2){a->x + b->x, a->y + b->y};
+}
+
+static inline struct vec2 inline_vec2_sub(const struct vec2 *a, const struct vec2 *b)
+{
+    return (struct vec2){a->x - b->x, a->y - b->y};
+}
+
+static inline struct vec2 inline_vec2_mul(const struct vec2 *vec, float multiplier)
+{
+    return (struct vec2){vec->x * multiplier, vec->y * multiplier};
+}
+
+static inline float inline_vec2_dot(const struct vec2 *a, const struct vec2 *b)
+{
+    return a->x * b->x + a->y * b->y;
+}
+
+static inline struct vec2 inline_vec2_normalized(const struct vec2 *v)
+{
+    return inline_vec2_mul(v, 1.0f / inline_vec2_length(v));
+}
+
+// Normal points up if a is left of b, see struct surface
+static inline struct vec2 inline_surface_normal(const struct surface *surface)
+{
+    const struct vec2 direction = inline_pos2_sub(&surface->b, &surface->a);
+    const struct vec2 normal = {-direction.y, direction.x};
+    return inline_vec2_normalized(&normal);
+}
+
+static inline void inline_apply_gravity(struct ball *ball, float delta)
+{
+    ball->velocity.y -= PHYSICS_GRAVITY * delta;
+}
+
+#define pos2_add inline_pos2_add
+#define pos2_sub inline_pos2_sub
+#define vec2_length_2 inline_vec2_length_2
+#define vec2_length inline_vec2_length
+#define vec2_add inline_vec2_add
+#define vec2_sub inline_vec2_sub
+#define vec2_mul inline_vec2_mul
+#define vec2_dot inline_vec2_dot
+#define vec2_normalized inline_vec2_normalized
+#define surface_normal inline_surface_normal
+#define apply_gravity inline_apply_gravity
+
+#endif
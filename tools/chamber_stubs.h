@@ -0,0 +1,36 @@
+// What a native tool needs to link breakout.c without the host or libphysics.
+// Include it right after "../breakout.c".
+//
+// logWasm() goes to stderr. Surfaces come from libphysics, so the collision
+// helpers below do nothing, and a run using them must not set any surfaces.
+// tools/physics_inline_check.c links the real libphysics instead.
+//
+// No <stdlib.h> in the tools: its rand() would clash with the chamber's.
+
+#ifndef CHAMBER_STUBS_H
+#define CHAMBER_STUBS_H
+
+#include <stdio.h>
+
+void logWasm(char *str, size_t len)
+{
+    fwrite(str, 1, len, stderr);
+}
+
+bool surface_collision_resolution(const struct surface *surface, const struct pos2 *p, const struct vec2 *v,
+                                  struct vec2 *out)
+{
+    return false;
+}
+
+void surface_push_if_colliding(const struct surface *surface, struct ball *ball, const struct vec2 *obj_velocity,
+                               float delta, float max_push)
+{
+}
+
+void apply_ball_collision(struct ball *ball, const struct vec2 *resolution, const struct vec2 *obj_normal,
+                          const struct vec2 *obj_velocity, float delta, float elasticity)
+{
+}
+
+#endif
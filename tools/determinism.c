@@ -0,0 +1,91 @@
+// Cross-build determinism check: runs a fixed script of chamber calls and
+// prints stateHash() along the way. Two builds are deterministic with respect
+// to each other when their outputs are identical. With -DPHYSICS_FIXED the
+// hashes are also checked against the golden ones below, and the tool exits
+// with 1 on the first difference or if no level was cleared: the script
+// clears 7, so level resets are covered.
+//
+//   gcc -O0 -DPHYSICS_FIXED tools/determinism.c -o determinism-O0 -lm
+//   gcc -O3 -march=native -ffast-math -ffp-contract=fast -DPHYSICS_FIXED tools/determinism.c -o determinism-fast -lm
+//   ./determinism-O0 > O0.txt && ./determinism-fast > fast.txt && cmp O0.txt fast.txt
+//
+// Without -DPHYSICS_FIXED the same comparison shows how far float chambers
+// drift, and nothing is checked. The script only goes through exports (init,
+// setPowerUps, ballsMemory, step, move_ball, stateHash), so a wasm host can
+// replay it against the wasm chamber and compare its hashes with golden[].
+
+#define WALLOC_NATIVE
+#define PHYSICS_INLINE
+#include "../breakout.c"
+#include "chamber_stubs.h"
+
+#include <stdio.h>
+
+#define BALLS 64
+#define STEPS 20000
+#define HASH_EVERY 1000
+
+#ifdef PHYSICS_FIXED
+// stateHash() every HASH_EVERY steps. Only changes with the chamber's rules:
+// regenerate them from a -O0 build when a change is meant to alter the game
+static const uint32_t golden[STEPS / HASH_EVERY] = {
+    0xad9de155, 0xb11d720c, 0x101b319c, 0x9708c042, 0x3ce21845, 0xe268f0d8, 0xc3a9796f,
+    0x2b8a199b, 0xd4448343, 0xa1cfccb2, 0xfce9be7a, 0x63ac9591, 0x25cf9f99, 0x9f1acccf,
+    0x6b3253ce, 0xd9d87782, 0xd21f1735, 0x413ffc06, 0x84e5aa49, 0x0897d1cb,
+};
+#endif
+
+// Ball i starts from integers over 65536, exact in float and on the Q16.16
+// grid
+static struct ball initial_ball(uint32_t i)
+{
+    uint32_t seed = i * 2654435761u + 1;
+    seed = seed * 1103515245 + 12345;
+    const float x = (float)(6554 + (seed >> 8) % 52428) / 65536.0f; // 0.1 to 0.9
+    seed = seed * 1103515245 + 12345;
+    const float vx = (float)((int32_t)((seed >> 8) % 131072) - 65536) / 65536.0f; // -1 to 1
+    seed = seed * 1103515245 + 12345;
+    const float vy = (float)(163840 + (seed >> 8) % 98304) / 65536.0f; // 2.5 to 4
+    return (struct ball){{x, 3277.0f / 65536.0f}, 655.0f / 65536.0f, {vx, vy}};
+}
+
+int main(void)
+{
+    init(BALLS, 0);
+    setPowerUps(1);
+    struct ball *balls = ballsMemory();
+    for (uint32_t i = 0; i < BALLS; i++)
+    {
+        balls[i] = initial_ball(i);
+    }
+
+    const float delta = 1.0f / 64.0f;
+    for (size_t i = 1; i <= STEPS; i++)
+    {
+        step(BALLS, delta);
+        for (size_t j = 0; j < BALLS; j++)
+        {
+            move_ball(&balls[j], delta);
+        }
+        if (i % HASH_EVERY != 0)
+            continue;
+        const uint32_t hash = stateHash(BALLS);
+        printf("%zu %08x\n", i, hash);
+#ifdef PHYSICS_FIXED
+        if (hash != golden[i / HASH_EVERY - 1])
+        {
+            printf("mismatch at step %zu: expected %08x\n", i, golden[i / HASH_EVERY - 1]);
+            return 1;
+        }
+#endif
+    }
+    printf("levels %zu, bricks %zu, chamber balls %zu\n", state->game_count, state->bricks_count, state->chamber_balls);
+#ifdef PHYSICS_FIXED
+    if (state->game_count == 0)
+    {
+        printf("no level cleared, the level reset was not exercised\n");
+        return 1;
+    }
+#endif
+    return 0;
+}
@@ -0,0 +1,144 @@
+// Checks that the draw list mode draws what the raster mode does: every few
+// steps of a native chamber run, each canvas size is rendered both ways, the
+// DrawRects of drawListMemory() are filled in order onto a canvas of their
+// own, and the result is compared pixel for pixel with canvasMemory().
+//
+//   gcc -O2 -DPHYSICS_INLINE tools/draw_list_check.c -o draw_list_check -lm
+//   ./draw_list_check
+//   ./draw_list_check -b 32 -s 5000 -k 50
+//
+// Only the defaults are compared: RGBA8888 pixels, flat bricks and no
+// overlay, which the draw list does not carry. Exits with 1 on any mismatch.
+
+#define WALLOC_NATIVE
+#include "../breakout.c"
+#include "chamber_stubs.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Odd sizes on purpose, bricks and particles round differently on them, and
+// a canvas narrower than a particle
+static const size_t sizes[][2] = {{640, 448}, {320, 224}, {1000, 700}, {97, 61}, {33, 17}, {1, 1}, {1280, 896}};
+#define SIZE_COUNT (sizeof(sizes) / sizeof(sizes[0]))
+#define MAX_PIXELS (1280 * 896)
+
+static uint32_t replayed[MAX_PIXELS];
+
+static size_t parse_size(const char *text)
+{
+    size_t value = 0;
+    sscanf(text, "%zu", &value);
+    return value;
+}
+
+// Fill the DrawRects in order, clipped to the canvas
+static void replay_draw_list(size_t width, size_t height)
+{
+    const DrawRect *rects = drawListMemory();
+    for (size_t i = 0; i < drawListCount(); i++)
+    {
+        const DrawRect *rect = &rects[i];
+        const size_t right = rect->x + rect->width < width ? rect->x + rect->width : width;
+        const size_t bottom = rect->y + rect->height < height ? rect->y + rect->height : height;
+        for (size_t y = rect->y; y < bottom; y++)
+        {
+            for (size_t x = rect->x; x < right; x++)
+            {
+                replayed[y * width + x] = rect->color;
+            }
+        }
+    }
+}
+
+// Pixels of the raster frame that differ from the replayed draw list. The
+// first one is reported
+static size_t compare_frame(size_t width, size_t height, size_t step_index)
+{
+    setRenderMode(RENDER_RASTER);
+    render(width, height);
+    const uint32_t *canvas = canvasMemory();
+    setRenderMode(RENDER_DRAW_LIST);
+    render(width, height);
+    replay_draw_list(width, height);
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < width * height; i++)
+    {
+        if (canvas[i] == replayed[i])
+            continue;
+        if (mismatches++ == 0)
+            printf("step %zu, %zux%zu: first mismatch at (%zu, %zu), raster %08x, draw list %08x\n", step_index,
+                   width, height, i % width, i / width, canvas[i], replayed[i]);
+    }
+    return mismatches;
+}
+
+int main(int argc, char **argv)
+{
+    size_t balls_count = 16;
+    size_t steps = 3000;
+    size_t check_every = 25;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 == argc)
+        {
+            fprintf(stderr, "missing value for %s\n", argv[i]);
+            return 1;
+        }
+        if (strcmp(argv[i], "-b") == 0)
+            balls_count = parse_size(argv[++i]);
+        else if (strcmp(argv[i], "-s") == 0)
+            steps = parse_size(argv[++i]);
+        else if (strcmp(argv[i], "-k") == 0)
+            check_every = parse_size(argv[++i]);
+        else
+        {
+            fprintf(stderr, "usage: %s [-b balls] [-s steps] [-k check every]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (check_every == 0)
+        check_every = 1;
+
+    init(balls_count, MAX_PIXELS);
+    setDebris(1);
+    struct ball *balls = ballsMemory();
+    uint32_t seed = 1;
+    for (size_t i = 0; i < balls_count; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        const float x = 0.1f + 0.8f * (float)((seed >> 8) & 0xffff) / 65535.0f;
+        seed = seed * 1103515245 + 12345;
+        const float vx = -1.0f + 2.0f * (float)((seed >> 8) & 0xffff) / 65535.0f;
+        balls[i] = (struct ball){{x, 0.05f}, 0.01f, {vx, 3.0f}};
+    }
+
+    const float delta = 1.0f / 60.0f;
+    size_t frames = 0;
+    size_t with_particles = 0;
+    size_t mismatches = 0;
+    for (size_t i = 0; i <= steps; i++)
+    {
+        if (i % check_every == 0)
+        {
+            for (size_t s = 0; s < SIZE_COUNT; s++)
+            {
+                mismatches += compare_frame(sizes[s][0], sizes[s][1], i);
+                frames++;
+                with_particles += particleCount() > 0;
+            }
+        }
+        step(balls_count, delta);
+        for (size_t b = 0; b < balls_count; b++)
+        {
+            move_ball(&balls[b], delta);
+        }
+        updateParticles(delta);
+    }
+    printf("%zu frames at %zu sizes (%zu with debris), %u bricks left: %zu mismatched pixels\n", frames,
+           (size_t)SIZE_COUNT, with_particles, (unsigned)state->bricks_count, mismatches);
+    deinit();
+    return mismatches ? 1 : 0;
+}
@@ -0,0 +1,175 @@
+// Headless many-game simulation on the batch engine (see batch.c), natively.
+//
+//   gcc -O2 -ffp-contract=off -DPHYSICS_INLINE tools/headless.c -o headless -lm
+//   ./headless                       # 4096 games of one ball, 10000 steps
+//   ./headless -g 100000 -b 3 -s 1000
+//   ./headless -g 64 --verify 2000   # compare with the scalar chamber
+//
+// Add -march=native for wider vectors, and -DBATCH_LANES=8 (or 16) to match.
+//
+// --verify K steps every game a second time, K steps long, through the
+// chamber's own init()/step() plus move_ball(), and checks that balls and
+// bricks come out with the same bits as in the batch engine. Pass the same
+// -ffp-contract and -D flags as the wasm build for the comparison to hold for
+// it too.
+
+#define WALLOC_NATIVE
+#include "../breakout.c"
+#include "../batch.c"
+#include "chamber_stubs.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static size_t parse_size(const char *text)
+{
+    size_t value = 0;
+    sscanf(text, "%zu", &value);
+    return value;
+}
+
+static uint32_t next_random(uint32_t *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 8;
+}
+
+static float random_range(uint32_t *seed, float low, float high)
+{
+    return low + (high - low) * (float)(next_random(seed) & 0xffff) / 65535.0f;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+// Balls start below the bricks, heading up
+static struct ball initial_ball(size_t game, size_t index)
+{
+    uint32_t seed = (uint32_t)(game * 7919 + index * 104729 + 1);
+    return (struct ball){
+        {random_range(&seed, 0.1f, 0.9f), 0.05f},
+        0.01f,
+        {random_range(&seed, -1.0f, 1.0f), random_range(&seed, 2.5f, 4.0f)}};
+}
+
+static bool same_ball(const struct ball *a, const struct ball *b)
+{
+    return memcmp(a, b, sizeof(*a)) == 0;
+}
+
+static size_t verify(Batch *batch, size_t steps, float delta)
+{
+    size_t mismatches = 0;
+    for (size_t game = 0; game < batch->games; game++)
+    {
+        init(batch->balls_per_game, 0);
+        struct ball *balls = ballsMemory();
+        for (size_t b = 0; b < batch->balls_per_game; b++)
+        {
+            balls[b] = initial_ball(game, b);
+        }
+        for (size_t i = 0; i < steps; i++)
+        {
+            step(batch->balls_per_game, delta);
+            for (size_t b = 0; b < batch->balls_per_game; b++)
+            {
+                move_ball(&balls[b], delta);
+            }
+        }
+
+        SaveState batch_state;
+        batch_get_state(batch, game, &batch_state);
+        bool same = memcmp(&batch_state, state, sizeof(SaveState)) == 0;
+        for (size_t b = 0; b < batch->balls_per_game; b++)
+        {
+            struct ball ball = batch_get_ball(batch, game, b);
+            same &= same_ball(&ball, &balls[b]);
+        }
+        if (!same && mismatches++ < 10)
+        {
+            fprintf(stderr, "game %zu differs: bricks %zu/%zu, levels %zu/%zu\n", game,
+                    batch_state.bricks_count, state->bricks_count, batch_state.game_count, state->game_count);
+        }
+    }
+    deinit();
+    return mismatches;
+}
+
+int main(int argc, char **argv)
+{
+    size_t games = 4096;
+    size_t balls_per_game = 1;
+    size_t steps = 10000;
+    size_t verify_steps = 0;
+    float delta = 1.0f / 60.0f;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 == argc)
+        {
+            fprintf(stderr, "missing value for %s\n", argv[i]);
+            return 1;
+        }
+        if (strcmp(argv[i], "-g") == 0)
+            games = parse_size(argv[++i]);
+        else if (strcmp(argv[i], "-b") == 0)
+            balls_per_game = parse_size(argv[++i]);
+        else if (strcmp(argv[i], "-s") == 0)
+            steps = parse_size(argv[++i]);
+        else if (strcmp(argv[i], "-d") == 0)
+            sscanf(argv[++i], "%f", &delta);
+        else if (strcmp(argv[i], "--verify") == 0)
+            verify_steps = parse_size(argv[++i]);
+        else
+        {
+            fprintf(stderr, "usage: %s [-g games] [-b balls] [-s steps] [-d delta] [--verify steps]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    Batch batch;
+    if (games == 0 || balls_per_game == 0 || !batch_init(&batch, games, balls_per_game))
+    {
+        fprintf(stderr, "could not set up %zu games of %zu balls\n", games, balls_per_game);
+        return 1;
+    }
+    for (size_t game = 0; game < batch.games; game++)
+    {
+        for (size_t b = 0; b < balls_per_game; b++)
+        {
+            struct ball ball = initial_ball(game, b);
+            batch_set_ball(&batch, game, b, &ball);
+        }
+    }
+
+    if (verify_steps)
+    {
+        for (size_t i = 0; i < verify_steps; i++)
+        {
+            batch_step(&batch, delta);
+        }
+        size_t mismatches = verify(&batch, verify_steps, delta);
+        printf("%zu games, %zu steps: %zu mismatches\n", batch.games, verify_steps, mismatches);
+        batch_deinit(&batch);
+        return mismatches != 0;
+    }
+
+    const uint64_t start = now_ns();
+    for (size_t i = 0; i < steps; i++)
+    {
+        batch_step(&batch, delta);
+    }
+    const double seconds = (now_ns() - start) / 1e9;
+
+    printf("%zu games x %zu balls, %zu steps of %gs, %d lanes\n", batch.games, balls_per_game, steps, delta, BATCH_LANES);
+    printf("%.3f s, %.1f M game-steps/s\n", seconds, batch.games * steps / seconds / 1e6);
+    printf("%llu bricks destroyed, %llu levels cleared (%.1f /s)\n", (unsigned long long)batch.bricks_destroyed,
+           (unsigned long long)batch.levels_cleared, batch.levels_cleared / seconds);
+    batch_deinit(&batch);
+    return 0;
+}
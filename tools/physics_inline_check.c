@@ -0,0 +1,203 @@
+// Checks that physics_inline.h computes the same bits as libphysics: each
+// inline_* function and the libphysics function it stands in for are run on
+// the same random inputs, and every float of their results is compared.
+//
+//   gcc -O2 tools/physics_inline_check.c -o physics_inline_check -L<libphysics dir> -lphysics -lm
+//   ./physics_inline_check
+//   ./physics_inline_check -n 10000000 -s 42
+//
+// Needs a native build of libphysics, so it only builds where one exists.
+// Build it with the float flags the chamber uses (-ffp-contract, -ffast-math,
+// -march...), since those decide whether the inline math rounds the same way.
+// NaNs compare equal to any other NaN, their sign and payload are not
+// specified. Exits with 1 on any mismatch.
+
+#include "../physics_inline.h"
+
+// Back to the libphysics functions for the names physics.h declares, the
+// inline ones stay reachable as inline_*
+#undef pos2_add
+#undef pos2_sub
+#undef vec2_length_2
+#undef vec2_length
+#undef vec2_add
+#undef vec2_sub
+#undef vec2_mul
+#undef vec2_dot
+#undef vec2_normalized
+#undef surface_normal
+#undef apply_gravity
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+static uint64_t seed = 1;
+static uint64_t checks = 0;
+static uint64_t mismatches = 0;
+
+static uint32_t next_random(void)
+{
+    seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+    return (uint32_t)(seed >> 32);
+}
+
+// Mostly chamber-sized values, with some of every other kind of float mixed
+// in: zeros, denormals, huge values, infinities and NaNs
+static float random_float(void)
+{
+    const uint32_t kind = next_random() % 16;
+    if (kind < 10)
+        return ((float)(next_random() >> 8) / 16777216.0f - 0.5f) * 8.0f;
+    if (kind == 10)
+        return (next_random() & 1) ? 0.0f : -0.0f;
+    const uint32_t bits = next_random();
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static struct pos2 random_pos2(void)
+{
+    return (struct pos2){random_float(), random_float()};
+}
+
+static struct vec2 random_vec2(void)
+{
+    return (struct vec2){random_float(), random_float()};
+}
+
+static bool same_float(float a, float b)
+{
+    if (a != a && b != b)
+        return true;
+    uint32_t a_bits, b_bits;
+    memcpy(&a_bits, &a, sizeof(a));
+    memcpy(&b_bits, &b, sizeof(b));
+    return a_bits == b_bits;
+}
+
+// Compare count floats of the two results, reporting the first mismatches of
+// each function with their inputs
+static void check(const char *name, const float *inline_result, const float *library_result, size_t count,
+                  const float *inputs, size_t input_count)
+{
+    static const char *reported = NULL;
+    static uint32_t reported_count = 0;
+    checks++;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (same_float(inline_result[i], library_result[i]))
+            continue;
+        mismatches++;
+        if (reported != name)
+        {
+            reported = name;
+            reported_count = 0;
+        }
+        if (reported_count++ < 3)
+        {
+            printf("%s: result %zu is %a inline, %a in libphysics, inputs", name, i, inline_result[i],
+                   library_result[i]);
+            for (size_t j = 0; j < input_count; j++)
+            {
+                printf(" %a", inputs[j]);
+            }
+            printf("\n");
+        }
+        return;
+    }
+}
+
+#define CHECK(name, inline_result, library_result, ...)                                                          \
+    do                                                                                                           \
+    {                                                                                                            \
+        const float inputs_[] = {__VA_ARGS__};                                                                   \
+        check(name, (const float *)&(inline_result), (const float *)&(library_result),                           \
+              sizeof(inline_result) / sizeof(float), inputs_, sizeof(inputs_) / sizeof(float));                  \
+    } while (0)
+
+static void check_once(void)
+{
+    const struct pos2 p = random_pos2();
+    const struct pos2 q = random_pos2();
+    const struct vec2 v = random_vec2();
+    const struct vec2 w = random_vec2();
+    const float f = random_float();
+
+    struct pos2 pos_inline = inline_pos2_add(&p, &v);
+    struct pos2 pos_library = pos2_add(&p, &v);
+    CHECK("pos2_add", pos_inline, pos_library, p.x, p.y, v.x, v.y);
+
+    struct vec2 vec_inline = inline_pos2_sub(&p, &q);
+    struct vec2 vec_library = pos2_sub(&p, &q);
+    CHECK("pos2_sub", vec_inline, vec_library, p.x, p.y, q.x, q.y);
+
+    float float_inline = inline_vec2_length_2(&v);
+    float float_library = vec2_length_2(&v);
+    CHECK("vec2_length_2", float_inline, float_library, v.x, v.y);
+
+    float_inline = inline_vec2_length(&v);
+    float_library = vec2_length(&v);
+    CHECK("vec2_length", float_inline, float_library, v.x, v.y);
+
+    vec_inline = inline_vec2_add(&v, &w);
+    vec_library = vec2_add(&v, &w);
+    CHECK("vec2_add", vec_inline, vec_library, v.x, v.y, w.x, w.y);
+
+    vec_inline = inline_vec2_sub(&v, &w);
+    vec_library = vec2_sub(&v, &w);
+    CHECK("vec2_sub", vec_inline, vec_library, v.x, v.y, w.x, w.y);
+
+    vec_inline = inline_vec2_mul(&v, f);
+    vec_library = vec2_mul(&v, f);
+    CHECK("vec2_mul", vec_inline, vec_library, v.x, v.y, f);
+
+    float_inline = inline_vec2_dot(&v, &w);
+    float_library = vec2_dot(&v, &w);
+    CHECK("vec2_dot", float_inline, float_library, v.x, v.y, w.x, w.y);
+
+    vec_inline = inline_vec2_normalized(&v);
+    vec_library = vec2_normalized(&v);
+    CHECK("vec2_normalized", vec_inline, vec_library, v.x, v.y);
+
+    const struct surface surface = {p, q};
+    vec_inline = inline_surface_normal(&surface);
+    vec_library = surface_normal(&surface);
+    CHECK("surface_normal", vec_inline, vec_library, p.x, p.y, q.x, q.y);
+
+    struct ball ball_inline = {p, random_float(), v};
+    struct ball ball_library = ball_inline;
+    inline_apply_gravity(&ball_inline, f);
+    apply_gravity(&ball_library, f);
+    CHECK("apply_gravity", ball_inline, ball_library, p.x, p.y, ball_inline.r, v.x, v.y, f);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t rounds = 1000000;
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 == argc)
+        {
+            fprintf(stderr, "missing value for %s\n", argv[i]);
+            return 1;
+        }
+        if (strcmp(argv[i], "-n") == 0)
+            sscanf(argv[++i], "%llu", (unsigned long long *)&rounds);
+        else if (strcmp(argv[i], "-s") == 0)
+            sscanf(argv[++i], "%llu", (unsigned long long *)&seed);
+        else
+        {
+            fprintf(stderr, "usage: %s [-n rounds] [-s seed]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    for (uint64_t i = 0; i < rounds; i++)
+    {
+        check_once();
+    }
+    printf("%llu calls compared, %llu mismatched\n", (unsigned long long)checks, (unsigned long long)mismatches);
+    return mismatches ? 1 : 0;
+}
@@ -0,0 +1,163 @@
+// Snapshot size and speed of the two save formats, see setSaveFormat().
+//
+//   gcc -O2 -DPHYSICS_INLINE tools/snapshot_bench.c -o snapshot_bench -lm
+//   ./snapshot_bench
+//
+// The grid of the chamber is fixed at compile time, so larger grids are
+// measured on the brick bitset codec alone (encode_bits()/decode_bits()),
+// with 108, 10k and 1M bricks in a few typical states. Raw bytes are what a
+// SaveState with a bitset of that size would take. The chamber's own grid is
+// also round-tripped through save() and load() in both formats.
+
+#define WALLOC_NATIVE
+#include "../breakout.c"
+#include "chamber_stubs.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_BRICKS 1000000
+#define MAX_BYTES ((MAX_BRICKS + 7) / 8)
+
+static uint8_t bits[MAX_BYTES];
+static uint8_t decoded[MAX_BYTES];
+static uint8_t encoded[MAX_ENCODED_BITS_SIZE(MAX_BYTES)];
+
+static uint64_t now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static uint32_t next_random(uint32_t *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 8;
+}
+
+typedef enum
+{
+    LEVEL_FULL,    // Nothing destroyed yet
+    LEVEL_STARTED, // 2% destroyed, in clusters like balls leave them
+    LEVEL_HALF,    // Every brick a coin flip
+    LEVEL_CLEARED, // 98% destroyed
+} LevelShape;
+
+static const char *shape_names[] = {"full", "started", "half", "cleared"};
+
+static void fill_level(size_t bricks, LevelShape shape)
+{
+    const size_t bytes = (bricks + 7) / 8;
+    uint32_t seed = 7;
+    mymemset(bits, shape == LEVEL_CLEARED ? 0xff : 0x00, bytes);
+    for (size_t i = 0; shape != LEVEL_FULL && i < bricks; i++)
+    {
+        const uint32_t roll = next_random(&seed) % 1000;
+        bool flip = shape == LEVEL_HALF ? roll < 500 : roll < 4;
+        // Neighbours of a flipped brick go with it
+        for (size_t j = 0; flip && j < 5 && i < bricks; j++, i++)
+        {
+            bits[i / 8] ^= 1 << (i % 8);
+        }
+    }
+    // Bits past the last brick stay clear, like in brick_save
+    if (bricks % 8)
+        bits[bytes - 1] &= (1 << (bricks % 8)) - 1;
+}
+
+static void bench_codec(size_t bricks, LevelShape shape)
+{
+    const size_t bytes = (bricks + 7) / 8;
+    fill_level(bricks, shape);
+    const size_t repeats = bricks < 100000 ? 100000 : 200;
+
+    size_t length = 0;
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < repeats; i++)
+    {
+        length = encode_bits(encoded, bits, bytes);
+        __asm__ volatile("" : : "r"(encoded) : "memory");
+    }
+    const double encode_ns = (double)(now_ns() - start) / repeats;
+
+    size_t read = 0;
+    start = now_ns();
+    for (size_t i = 0; i < repeats; i++)
+    {
+        read = decode_bits(decoded, bytes, encoded, length);
+        __asm__ volatile("" : : "r"(decoded) : "memory");
+    }
+    const double decode_ns = (double)(now_ns() - start) / repeats;
+
+    const bool same = read == length && memcmp(bits, decoded, bytes) == 0;
+    printf("%8zu %-8s %9zu %9zu %11.1f %11.1f%s\n", bricks, shape_names[shape], sizeof(SaveState) - BRICK_SAVE_SIZE + bytes,
+           1 + 4 + length, encode_ns, decode_ns, same ? "" : "  MISMATCH");
+}
+
+// save() then load() on the chamber, in format, with a few chamber balls.
+// Returns whether the state came back the same
+static bool round_trip(SaveFormat format, size_t *size, double *save_ns, double *load_ns)
+{
+    init(4, 0);
+    setSaveFormat(format);
+    setPowerUps(1);
+    struct ball *balls = ballsMemory();
+    for (size_t i = 0; i < 4; i++)
+    {
+        balls[i] = (struct ball){{0.2f + 0.2f * i, 0.05f}, 0.01f, {0.5f - 0.3f * i, 3.0f}};
+    }
+    for (size_t i = 0; i < 200; i++)
+    {
+        step(4, 1.0f / 60.0f);
+        for (size_t b = 0; b < 4; b++)
+        {
+            move_ball(&balls[b], 1.0f / 60.0f);
+        }
+    }
+
+    const size_t repeats = 100000;
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < repeats; i++)
+    {
+        save();
+    }
+    *save_ns = (double)(now_ns() - start) / repeats;
+    *size = saveSize();
+
+    SaveState before = *state;
+    start = now_ns();
+    for (size_t i = 0; i < repeats; i++)
+    {
+        load();
+    }
+    *load_ns = (double)(now_ns() - start) / repeats;
+    const bool same = memcmp(&before, state, sizeof(SaveState)) == 0;
+    deinit();
+    return same;
+}
+
+int main(void)
+{
+    printf("  bricks level    raw bytes compact  encode ns   decode ns\n");
+    const size_t sizes[] = {BRICKS_PER_ROW * BRICK_ROWS, 10000, MAX_BRICKS};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        for (LevelShape shape = LEVEL_FULL; shape <= LEVEL_CLEARED; shape++)
+        {
+            bench_codec(sizes[i], shape);
+        }
+    }
+    printf("(compact counts a tag byte and 4 bytes of small counters)\n\n");
+
+    for (SaveFormat format = SAVE_FORMAT_RAW; format <= SAVE_FORMAT_COMPACT; format++)
+    {
+        size_t size;
+        double save_ns, load_ns;
+        const bool same = round_trip(format, &size, &save_ns, &load_ns);
+        printf("%s save()/load(): %zu bytes, %.1f ns save, %.1f ns load%s\n",
+               format == SAVE_FORMAT_RAW ? "raw" : "compact", size, save_ns, load_ns, same ? "" : ", MISMATCH");
+    }
+    return 0;
+}
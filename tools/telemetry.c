@@ -0,0 +1,201 @@
+// Collision telemetry of a native chamber run, as CSV or as a PPM heatmap.
+//
+//   gcc -O2 -DPHYSICS_INLINE tools/telemetry.c -o telemetry -lm
+//   ./telemetry                        # 8 balls, 20000 steps, CSV on stdout
+//   ./telemetry -b 32 -s 100000 > telemetry.csv
+//   ./telemetry --ppm hits.ppm         # brick hits, one pixel per brick
+//   ./telemetry --ppm visits.ppm --visits
+//
+// The CSV has one "cell" row per brick (hits and broad phase visits), one
+// "tests" row per bucket of the brick test histogram and one "level" row per
+// cleared level. Visits and the histogram are summed from cell_tests. The run
+// is repeated without and with telemetry, and the cost of the counters is
+// reported on stderr.
+
+#define WALLOC_NATIVE
+#include "../breakout.c"
+#include "chamber_stubs.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static size_t parse_size(const char *text)
+{
+    size_t value = 0;
+    sscanf(text, "%zu", &value);
+    return value;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+// Same starting balls on every run: below the bricks, heading up
+static void place_balls(struct ball *balls, size_t count)
+{
+    uint32_t seed = 1;
+    for (size_t i = 0; i < count; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        const float x = 0.1f + 0.8f * (float)((seed >> 8) & 0xffff) / 65535.0f;
+        seed = seed * 1103515245 + 12345;
+        const float vx = -1.0f + 2.0f * (float)((seed >> 8) & 0xffff) / 65535.0f;
+        balls[i] = (struct ball){{x, 0.05f}, 0.01f, {vx, 3.0f}};
+    }
+}
+
+// Nanoseconds per step of a fresh match
+static double run(size_t balls_count, size_t steps, float delta, bool with_telemetry)
+{
+    init(balls_count, 0);
+    setTelemetry(with_telemetry);
+    struct ball *balls = ballsMemory();
+    place_balls(balls, balls_count);
+    const uint64_t start = now_ns();
+    for (size_t i = 0; i < steps; i++)
+    {
+        step(balls_count, delta);
+        for (size_t b = 0; b < balls_count; b++)
+        {
+            move_ball(&balls[b], delta);
+        }
+    }
+    return (double)(now_ns() - start) / steps;
+}
+
+static uint32_t visits[BRICKS_PER_ROW * BRICK_ROWS];
+static uint64_t tests_histogram[TELEMETRY_MAX_TESTS + 1];
+
+static void sum_cell_tests(const Telemetry *t)
+{
+    for (size_t cell = 0; cell < BRICKS_PER_ROW * BRICK_ROWS; cell++)
+    {
+        for (size_t tests = 0; tests <= TELEMETRY_MAX_TESTS; tests++)
+        {
+            visits[cell] += t->cell_tests[cell][tests];
+            tests_histogram[tests] += t->cell_tests[cell][tests];
+        }
+    }
+}
+
+static void write_csv(const Telemetry *t)
+{
+    printf("kind,x,y,value,extra\n");
+    for (size_t y = 0; y < BRICK_ROWS; y++)
+    {
+        for (size_t x = 0; x < BRICKS_PER_ROW; x++)
+        {
+            const size_t cell = x + y * BRICKS_PER_ROW;
+            printf("cell,%zu,%zu,%u,%u\n", x, y, t->brick_hits[cell], visits[cell]);
+        }
+    }
+    for (size_t tests = 0; tests <= TELEMETRY_MAX_TESTS; tests++)
+    {
+        printf("tests,%zu,,%llu,\n", tests, (unsigned long long)tests_histogram[tests]);
+    }
+    const size_t first = t->levels > TELEMETRY_LEVELS ? t->levels - TELEMETRY_LEVELS : 0;
+    for (size_t level = first; level < t->levels; level++)
+    {
+        printf("level,%zu,,%u,%g\n", level, t->clear_steps[level % TELEMETRY_LEVELS],
+               t->clear_time[level % TELEMETRY_LEVELS]);
+    }
+}
+
+// Black (never) to red to yellow to white (most), one pixel per brick, rows
+// from the top of the field down
+static bool write_ppm(const char *path, const uint32_t *counts)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file)
+        return false;
+    uint32_t most = 1;
+    for (size_t i = 0; i < BRICKS_PER_ROW * BRICK_ROWS; i++)
+    {
+        most = counts[i] > most ? counts[i] : most;
+    }
+    fprintf(file, "P6\n%d %d\n255\n", BRICKS_PER_ROW, BRICK_ROWS);
+    for (size_t i = 0; i < BRICKS_PER_ROW * BRICK_ROWS; i++)
+    {
+        const uint32_t heat = (uint32_t)((uint64_t)counts[i] * 765 / most);
+        const uint8_t pixel[3] = {heat > 255 ? 255 : heat, heat > 510 ? 255 : heat > 255 ? heat - 255 : 0,
+                                  heat > 510 ? heat - 510 : 0};
+        fwrite(pixel, 1, 3, file);
+    }
+    return fclose(file) == 0;
+}
+
+int main(int argc, char **argv)
+{
+    size_t balls_count = 8;
+    size_t steps = 20000;
+    float delta = 1.0f / 60.0f;
+    const char *ppm = NULL;
+    bool show_visits = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--visits") == 0)
+        {
+            show_visits = true;
+            continue;
+        }
+        if (i + 1 == argc)
+        {
+            fprintf(stderr, "missing value for %s\n", argv[i]);
+            return 1;
+        }
+        if (strcmp(argv[i], "-b") == 0)
+            balls_count = parse_size(argv[++i]);
+        else if (strcmp(argv[i], "-s") == 0)
+            steps = parse_size(argv[++i]);
+        else if (strcmp(argv[i], "-d") == 0)
+            sscanf(argv[++i], "%f", &delta);
+        else if (strcmp(argv[i], "--ppm") == 0)
+            ppm = argv[++i];
+        else
+        {
+            fprintf(stderr, "usage: %s [-b balls] [-s steps] [-d delta] [--ppm file [--visits]]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (balls_count == 0 || steps == 0)
+    {
+        fprintf(stderr, "need at least one ball and one step\n");
+        return 1;
+    }
+
+    // Best of a few interleaved rounds, the difference is within the noise of
+    // a single one. The last run leaves its telemetry behind
+    double plain = 0.0;
+    double counted = 0.0;
+    for (size_t round = 0; round < 5; round++)
+    {
+        const double without = run(balls_count, steps, delta, false);
+        const double with = run(balls_count, steps, delta, true);
+        plain = round == 0 || without < plain ? without : plain;
+        counted = round == 0 || with < counted ? with : counted;
+    }
+    const Telemetry *t = telemetryMemory();
+    fprintf(stderr, "%zu balls, %zu steps: %.1f ns/step, %.1f ns/step with telemetry (%+.1f%%), %u levels\n",
+            balls_count, steps, plain, counted, (counted / plain - 1.0) * 100.0, t->levels);
+
+    sum_cell_tests(t);
+    if (ppm)
+    {
+        if (!write_ppm(ppm, show_visits ? visits : t->brick_hits))
+        {
+            fprintf(stderr, "could not write %s\n", ppm);
+            return 1;
+        }
+    }
+    else
+    {
+        write_csv(t);
+    }
+    deinit();
+    return 0;
+}
@@ -0,0 +1,141 @@
+// Chrome trace-event timeline of a native chamber run, see trace.h.
+//
+//   gcc -O2 -DCHAMBER_TRACE -DPHYSICS_INLINE tools/trace.c -o trace -lm
+//   ./trace                            # writes trace.json
+//   ./trace -b 200 -f 600 -o run.json
+//   gcc -O2 -DCHAMBER_TRACE -DCHAMBER_THREADS -DPHYSICS_INLINE tools/trace.c -o trace -lm -pthread
+//
+// Each frame steps the chamber, renders it, and every -k frames saves and
+// loads it the way a client receiving snapshots would. Open the output in
+// chrome://tracing or ui.perfetto.dev: every thread that recorded events
+// (render workers included, with CHAMBER_THREADS) gets its own track.
+
+#define WALLOC_NATIVE
+#include "../breakout.c"
+#include "chamber_stubs.h"
+
+#ifndef CHAMBER_TRACE
+#error "build with -DCHAMBER_TRACE"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+static size_t parse_size(const char *text)
+{
+    size_t value = 0;
+    sscanf(text, "%zu", &value);
+    return value;
+}
+
+static TraceEvent drained[4096];
+static uint64_t trace_start;
+static size_t written = 0;
+
+// Append what the rings hold so far, so that long runs do not drop events
+static void write_events(FILE *file)
+{
+    for (uint32_t thread = 0; thread < trace_threads(); thread++)
+    {
+        size_t count;
+        while ((count = trace_drain(thread, drained, sizeof(drained) / sizeof(drained[0]))) > 0)
+        {
+            for (size_t i = 0; i < count; i++)
+            {
+                fprintf(file, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                        written++ ? "," : "", drained[i].name, thread, (drained[i].begin - trace_start) / 1e3,
+                        (drained[i].end - drained[i].begin) / 1e3);
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    size_t balls_count = 16;
+    size_t frames = 300;
+    size_t snapshot_every = 10;
+    size_t width = 640;
+    size_t height = 448;
+    const char *path = "trace.json";
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 == argc)
+        {
+            fprintf(stderr, "missing value for %s\n", argv[i]);
+            return 1;
+        }
+        if (strcmp(argv[i], "-b") == 0)
+            balls_count = parse_size(argv[++i]);
+        else if (strcmp(argv[i], "-f") == 0)
+            frames = parse_size(argv[++i]);
+        else if (strcmp(argv[i], "-k") == 0)
+            snapshot_every = parse_size(argv[++i]);
+        else if (strcmp(argv[i], "-w") == 0)
+            width = parse_size(argv[++i]);
+        else if (strcmp(argv[i], "-h") == 0)
+            height = parse_size(argv[++i]);
+        else if (strcmp(argv[i], "-o") == 0)
+            path = argv[++i];
+        else
+        {
+            fprintf(stderr, "usage: %s [-b balls] [-f frames] [-k snapshot every] [-w width] [-h height] [-o file]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    FILE *file = fopen(path, "w");
+    if (!file)
+    {
+        fprintf(stderr, "could not write %s\n", path);
+        return 1;
+    }
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    trace_start = trace_now();
+
+    init(balls_count, width * height);
+    setDebris(1);
+    struct ball *balls = ballsMemory();
+    uint32_t seed = 1;
+    for (size_t i = 0; i < balls_count; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        const float x = 0.1f + 0.8f * (float)((seed >> 8) & 0xffff) / 65535.0f;
+        seed = seed * 1103515245 + 12345;
+        const float vx = -1.0f + 2.0f * (float)((seed >> 8) & 0xffff) / 65535.0f;
+        balls[i] = (struct ball){{x, 0.05f}, 0.01f, {vx, 3.0f}};
+    }
+
+    const float delta = 1.0f / 60.0f;
+    for (size_t frame = 0; frame < frames; frame++)
+    {
+        step(balls_count, delta);
+        for (size_t b = 0; b < balls_count; b++)
+        {
+            move_ball(&balls[b], delta);
+        }
+        updateParticles(delta);
+        if (snapshot_every && frame % snapshot_every == 0)
+        {
+            save();
+            load();
+        }
+        render(width, height);
+        write_events(file);
+    }
+    deinit();
+    write_events(file);
+    fprintf(file, "\n]}\n");
+    fclose(file);
+
+    uint32_t dropped = 0;
+    for (uint32_t thread = 0; thread < trace_threads(); thread++)
+    {
+        dropped += trace_rings[thread].dropped;
+    }
+    printf("%zu frames, %zu events from %u threads (%u dropped) in %s\n", frames, written, trace_threads(), dropped,
+           path);
+    return 0;
+}
@@ -0,0 +1,342 @@
+// Native walloc microbenchmarks, comparing walloc with the system allocator.
+//
+// walloc runs on its mmap-backed stand-in for the wasm linear memory (see
+// WALLOC_NATIVE in walloc.c). To compare against another allocator, preload
+// it: the "system" column is whatever malloc the process ends up with.
+//
+//   gcc -O2 -DNDEBUG tools/walloc_bench.c -o walloc_bench -lpthread
+//   ./walloc_bench                 # every benchmark
+//   ./walloc_bench churn mixed     # a subset
+//   ./walloc_bench -t 16 threads   # thread scaling, needs -DWALLOC_THREADS
+//   LD_PRELOAD=libjemalloc.so ./walloc_bench
+//
+// Every (benchmark, allocator) pair runs in a forked child so that the peak
+// RSS reported for it is its own.
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static void *system_malloc(size_t size)
+{
+    return malloc(size);
+}
+
+static void system_free(void *ptr)
+{
+    free(ptr);
+}
+
+#define WALLOC_NATIVE
+#include "../walloc.c"
+
+typedef struct
+{
+    const char *name;
+    void *(*alloc)(size_t);
+    void (*release)(void *);
+} Allocator;
+
+static const Allocator allocators[] = {
+    {"walloc", walloc_malloc, walloc_free},
+    {"system", system_malloc, system_free},
+};
+
+#define ALLOCATOR_COUNT (sizeof(allocators) / sizeof(allocators[0]))
+
+// Deterministic per-thread generator, so every allocator sees the same trace
+static uint32_t next_random(uint32_t *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 8;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+// Touch the first and last byte so that both allocators pay for faulting in
+// the memory they hand out
+static void *touch(void *ptr, size_t size)
+{
+    if (ptr)
+    {
+        ((volatile uint8_t *)ptr)[0] = 1;
+        ((volatile uint8_t *)ptr)[size - 1] = 1;
+    }
+    return ptr;
+}
+
+#define CHURN_SLOTS 4096
+#define CHURN_OPS 20000000
+
+// Random alloc/free over a fixed window of live objects, one small size
+// class at a time
+static size_t bench_churn(const Allocator *a, uint32_t seed)
+{
+    static void *slots[CHURN_SLOTS];
+    static const size_t sizes[] = {8, 16, 24, 32, 48, 64, 80, 128, 256};
+    const size_t size_count = sizeof(sizes) / sizeof(sizes[0]);
+    size_t ops = 0;
+
+    for (size_t s = 0; s < size_count; s++)
+    {
+        for (size_t i = 0; i < CHURN_OPS / size_count; i++, ops++)
+        {
+            size_t slot = next_random(&seed) % CHURN_SLOTS;
+            if (slots[slot])
+            {
+                a->release(slots[slot]);
+                slots[slot] = NULL;
+            }
+            else
+            {
+                slots[slot] = touch(a->alloc(sizes[s]), sizes[s]);
+            }
+        }
+        for (size_t i = 0; i < CHURN_SLOTS; i++)
+        {
+            a->release(slots[i]);
+            slots[i] = NULL;
+        }
+    }
+    return ops;
+}
+
+#define FRAGMENT_OBJECTS 4000
+#define FRAGMENT_ROUNDS 10
+
+// Fill the heap with large objects of mixed sizes, free every other one, then
+// allocate sizes that fit none of the holes exactly
+static size_t bench_fragmentation(const Allocator *a, uint32_t seed)
+{
+    static void *objects[FRAGMENT_OBJECTS];
+    size_t ops = 0;
+
+    for (size_t round = 0; round < FRAGMENT_ROUNDS; round++)
+    {
+        for (size_t i = 0; i < FRAGMENT_OBJECTS; i++, ops++)
+        {
+            size_t size = 300 + next_random(&seed) % (16 * 1024);
+            objects[i] = touch(a->alloc(size), size);
+        }
+        for (size_t i = round % 2; i < FRAGMENT_OBJECTS; i += 2, ops++)
+        {
+            a->release(objects[i]);
+            objects[i] = NULL;
+        }
+        for (size_t i = round % 2; i < FRAGMENT_OBJECTS; i += 2, ops++)
+        {
+            size_t size = 1024 + next_random(&seed) % (24 * 1024);
+            objects[i] = touch(a->alloc(size), size);
+        }
+        for (size_t i = 0; i < FRAGMENT_OBJECTS; i++, ops++)
+        {
+            a->release(objects[i]);
+            objects[i] = NULL;
+        }
+    }
+    return ops;
+}
+
+#define MIXED_SLOTS 16384
+#define MIXED_OPS 10000000
+
+// Size and lifetime mix shaped like a chamber host: mostly short-lived small
+// objects, some buffers of a few KB, and rare canvas-sized blocks
+static size_t bench_mixed(const Allocator *a, uint32_t seed)
+{
+    static void *slots[MIXED_SLOTS];
+    size_t ops = 0;
+
+    for (size_t i = 0; i < MIXED_OPS; i++, ops++)
+    {
+        uint32_t r = next_random(&seed);
+        // Low slots turn over quickly, high slots hold long-lived objects
+        size_t slot = (r & 1) ? r % 256 : r % MIXED_SLOTS;
+        if (slots[slot])
+        {
+            a->release(slots[slot]);
+            slots[slot] = NULL;
+            continue;
+        }
+
+        uint32_t kind = next_random(&seed) % 1000;
+        size_t size;
+        if (kind < 900)
+            size = 8 + next_random(&seed) % 120;
+        else if (kind < 995)
+            size = 256 + next_random(&seed) % 4096;
+        else
+            size = 64 * 1024 + next_random(&seed) % (1024 * 1024);
+        slots[slot] = touch(a->alloc(size), size);
+    }
+    for (size_t i = 0; i < MIXED_SLOTS; i++)
+    {
+        a->release(slots[i]);
+        slots[i] = NULL;
+    }
+    return ops;
+}
+
+typedef struct
+{
+    const Allocator *allocator;
+    uint32_t seed;
+    size_t ops;
+} ThreadJob;
+
+#define THREAD_SLOTS 1024
+#define THREAD_OPS 5000000
+
+static void *thread_churn(void *arg)
+{
+    ThreadJob *job = arg;
+    void *slots[THREAD_SLOTS] = {0};
+    for (size_t i = 0; i < THREAD_OPS; i++)
+    {
+        uint32_t r = next_random(&job->seed);
+        size_t slot = r % THREAD_SLOTS;
+        if (slots[slot])
+        {
+            job->allocator->release(slots[slot]);
+            slots[slot] = NULL;
+        }
+        else
+        {
+            size_t size = 8 + (r >> 12) % 248;
+            slots[slot] = touch(job->allocator->alloc(size), size);
+        }
+    }
+    for (size_t i = 0; i < THREAD_SLOTS; i++)
+        job->allocator->release(slots[i]);
+#ifdef WALLOC_THREADS
+    walloc_thread_flush();
+#endif
+    job->ops = THREAD_OPS;
+    return NULL;
+}
+
+static size_t thread_count = 1;
+
+// Independent small-object churn on thread_count threads
+static size_t bench_threads(const Allocator *a, uint32_t seed)
+{
+#ifndef WALLOC_THREADS
+    if (a->alloc == walloc_malloc && thread_count > 1)
+    {
+        fprintf(stderr, "walloc is not thread-safe without -DWALLOC_THREADS\n");
+        return 0;
+    }
+#endif
+    pthread_t threads[256];
+    ThreadJob jobs[256];
+    size_t ops = 0;
+    for (size_t i = 0; i < thread_count; i++)
+    {
+        jobs[i] = (ThreadJob){a, seed + (uint32_t)i, 0};
+        pthread_create(&threads[i], NULL, thread_churn, &jobs[i]);
+    }
+    for (size_t i = 0; i < thread_count; i++)
+    {
+        pthread_join(threads[i], NULL);
+        ops += jobs[i].ops;
+    }
+    return ops;
+}
+
+typedef struct
+{
+    const char *name;
+    size_t (*run)(const Allocator *, uint32_t);
+} Benchmark;
+
+static const Benchmark benchmarks[] = {
+    {"churn", bench_churn},
+    {"fragmentation", bench_fragmentation},
+    {"mixed", bench_mixed},
+    {"threads", bench_threads},
+};
+
+#define BENCHMARK_COUNT (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+// Run one pair in a child process; the parent reads its peak RSS from wait4()
+static void run_isolated(const Benchmark *b, const Allocator *a)
+{
+    int pipe_fds[2];
+    if (pipe(pipe_fds))
+    {
+        perror("pipe");
+        exit(1);
+    }
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(pipe_fds[0]);
+        uint64_t start = now_ns();
+        uint64_t result[2] = {b->run(a, 12), 0};
+        result[1] = now_ns() - start;
+        if (write(pipe_fds[1], result, sizeof(result)) != sizeof(result))
+            _exit(1);
+        _exit(0);
+    }
+
+    close(pipe_fds[1]);
+    uint64_t result[2] = {0, 0};
+    ssize_t got = read(pipe_fds[0], result, sizeof(result));
+    close(pipe_fds[0]);
+
+    int status;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    if (got != sizeof(result) || result[0] == 0)
+    {
+        printf("%-14s %-8s %10s\n", b->name, a->name, "failed");
+        return;
+    }
+    printf("%-14s %-8s %10.1f %12.1f %12ld\n", b->name, a->name,
+           (double)result[1] / result[0], result[1] / 1e6, usage.ru_maxrss);
+}
+
+int main(int argc, char **argv)
+{
+    const char *selected[BENCHMARK_COUNT];
+    size_t selected_count = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+        {
+            thread_count = strtoul(argv[++i], NULL, 10);
+            thread_count = thread_count == 0 ? 1 : thread_count > 256 ? 256 : thread_count;
+        }
+        else if (selected_count < BENCHMARK_COUNT)
+        {
+            selected[selected_count++] = argv[i];
+        }
+    }
+
+    printf("%-14s %-8s %10s %12s %12s\n", "benchmark", "alloc", "ns/op", "total ms", "peak RSS KB");
+    for (size_t i = 0; i < BENCHMARK_COUNT; i++)
+    {
+        bool wanted = selected_count == 0;
+        for (size_t j = 0; j < selected_count; j++)
+            wanted |= strcmp(selected[j], benchmarks[i].name) == 0;
+        if (!wanted)
+            continue;
+        for (size_t j = 0; j < ALLOCATOR_COUNT; j++)
+            run_isolated(&benchmarks[i], &allocators[j]);
+    }
+    return 0;
+}
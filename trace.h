@@ -0,0 +1,121 @@
+// Scoped trace points for native runs, dumped as Chrome trace-event JSON
+// (chrome://tracing or ui.perfetto.dev) by tools/trace.c
+//
+// TRACE_SCOPE("name") at the top of a block records one complete event, from
+// where it stands to where the block is left, through the cleanup attribute.
+// Each thread writes its events to a ring of its own, which it claims on its
+// first event: single producer/single consumer like the chamber's other
+// rings, so recording never takes a lock. trace_drain() reads them back.
+//
+// Only built with -DCHAMBER_TRACE, which needs a native build (WALLOC_NATIVE)
+// for the clock. Otherwise TRACE_SCOPE expands to nothing, and none of the
+// code below exists.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#ifdef CHAMBER_TRACE
+
+#ifndef WALLOC_NATIVE
+#error "tracing needs a native build, define WALLOC_NATIVE"
+#endif
+
+#include <stdint.h>
+#include <time.h>
+
+#ifndef TRACE_MAX_THREADS
+#define TRACE_MAX_THREADS 16
+#endif
+// Events per thread, must be a power of two. Events past a full ring are
+// dropped until trace_drain() makes room
+#ifndef TRACE_RING_CAPACITY
+#define TRACE_RING_CAPACITY (1 << 16)
+#endif
+
+typedef struct
+{
+    const char *name; // String literal passed to TRACE_SCOPE
+    uint64_t begin;   // Nanoseconds, CLOCK_MONOTONIC
+    uint64_t end;
+} TraceEvent;
+
+// The thread owning the ring owns head, trace_drain() owns tail
+typedef struct
+{
+    uint32_t head;
+    uint32_t tail;
+    uint32_t dropped;
+    TraceEvent events[TRACE_RING_CAPACITY];
+} TraceRing;
+
+typedef struct
+{
+    const char *name;
+    uint64_t begin;
+} TraceScope;
+
+static TraceRing trace_rings[TRACE_MAX_THREADS];
+static uint32_t trace_ring_count = 0;
+// Index of this thread's ring plus one, 0 before its first event. Threads
+// past TRACE_MAX_THREADS are not traced
+static _Thread_local uint32_t trace_thread = 0;
+
+static inline uint64_t trace_now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static inline void trace_end(TraceScope *scope)
+{
+    if (trace_thread == 0)
+        trace_thread = __atomic_fetch_add(&trace_ring_count, 1, __ATOMIC_RELAXED) + 1;
+    if (trace_thread > TRACE_MAX_THREADS)
+        return;
+    TraceRing *ring = &trace_rings[trace_thread - 1];
+    const uint32_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == TRACE_RING_CAPACITY)
+    {
+        ring->dropped++;
+        return;
+    }
+    ring->events[head % TRACE_RING_CAPACITY] = (TraceEvent){scope->name, scope->begin, trace_now()};
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Number of threads that recorded events so far, i.e. of rings to drain
+static inline uint32_t trace_threads(void)
+{
+    const uint32_t count = __atomic_load_n(&trace_ring_count, __ATOMIC_RELAXED);
+    return count < TRACE_MAX_THREADS ? count : TRACE_MAX_THREADS;
+}
+
+// Move up to max events of thread's ring to out, oldest first. Returns how
+// many were moved
+static inline size_t trace_drain(uint32_t thread, TraceEvent *out, size_t max)
+{
+    TraceRing *ring = &trace_rings[thread];
+    const uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = ring->tail;
+    size_t count = 0;
+    for (; tail != head && count < max; tail++)
+    {
+        out[count++] = ring->events[tail % TRACE_RING_CAPACITY];
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    return count;
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) \
+    TraceScope TRACE_CONCAT(trace_scope_, __LINE__) __attribute__((cleanup(trace_end))) = {(name), trace_now()}
+
+#else
+
+#define TRACE_SCOPE(name) ((void)0)
+
+#endif
+
+#endif
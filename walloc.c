@@ -20,11 +20,20 @@
 // OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
 // WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
+#ifdef WALLOC_NATIVE
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
 typedef __SIZE_TYPE__ size_t;
 typedef __UINTPTR_TYPE__ uintptr_t;
 typedef __UINT8_TYPE__ uint8_t;
 
+#ifndef NULL
 #define NULL ((void *)0)
+#endif
+
+#include "trace.h"
 
 #define STATIC_ASSERT_EQ(a, b) _Static_assert((a) == (b), "eq")
 
@@ -184,14 +193,130 @@ static inline struct large_object *get_large_object(void *ptr)
 static struct freelist *small_object_freelists[SMALL_OBJECT_CHUNK_KINDS];
 static struct large_object *large_objects;
 
+#ifdef WALLOC_THREADS
+// Thread-caching mode, for multi-threaded native builds (or wasm builds with
+// shared memory, where each thread must have had its TLS block set up).
+//
+// Small objects are served from a per-thread cache without any
+// synchronization.  A cache that runs dry takes a batch of
+// THREAD_CACHE_BATCH objects from the shared pool, and a cache that grows to
+// twice that size hands a batch back.  Everything shared -- the shared pool,
+// the large object freelist and the page allocator -- sits behind a single
+// spin lock, which the small object path therefore only takes once per batch.
+//
+// In this mode small_object_freelists[] is the shared pool's overflow list;
+// whole batches are kept in shared_batches[] so that handing one over is
+// O(1).  Objects cached by a thread are lost when it exits unless it calls
+// walloc_thread_flush() first.
+#define THREAD_CACHE_BATCH 32
+#define SHARED_BATCHES 64
+
+struct thread_cache
+{
+  struct freelist *freelists[SMALL_OBJECT_CHUNK_KINDS];
+  unsigned counts[SMALL_OBJECT_CHUNK_KINDS];
+};
+static _Thread_local struct thread_cache thread_cache;
+
+static struct freelist *shared_batches[SMALL_OBJECT_CHUNK_KINDS][SHARED_BATCHES];
+static unsigned shared_batch_counts[SMALL_OBJECT_CHUNK_KINDS];
+
+// Called while spinning on the heap lock.  Native builds yield to the
+// scheduler, since threads may outnumber cores; define it to override.
+#if !defined(WALLOC_RELAX) && defined(WALLOC_NATIVE)
+#define WALLOC_RELAX() sched_yield()
+#endif
+#ifndef WALLOC_RELAX
+#define WALLOC_RELAX() \
+  do               \
+  {                \
+  } while (0)
+#endif
+
+static int heap_lock;
+
+// Out of line, so that the paths taking the lock stay free of calls (and of
+// saved registers) unless another thread holds it.
+static __attribute__((noinline)) void wait_for_heap_lock(void)
+{
+  do
+  {
+    while (__atomic_load_n(&heap_lock, __ATOMIC_RELAXED))
+      WALLOC_RELAX();
+  } while (__atomic_exchange_n(&heap_lock, 1, __ATOMIC_ACQUIRE));
+}
+
+static inline void lock_heap(void)
+{
+  if (__atomic_exchange_n(&heap_lock, 1, __ATOMIC_ACQUIRE))
+    wait_for_heap_lock();
+}
+static inline void unlock_heap(void)
+{
+  __atomic_store_n(&heap_lock, 0, __ATOMIC_RELEASE);
+}
+#else
+static inline void lock_heap(void) {}
+static inline void unlock_heap(void) {}
+#endif
+
+#ifdef WALLOC_NATIVE
+// Native stand-in for the wasm linear memory, so that walloc can be built and
+// benchmarked on Linux.  The whole "memory" is one mmap reservation; its pages
+// become accessible as the heap grows, like memory.grow would.  Page numbers
+// are absolute (address / PAGE_SIZE), which lets allocate_pages() keep
+// treating memory sizes as addresses.  malloc and free are renamed so they
+// can coexist with the C library's.
+#define WALLOC_NATIVE_RESERVE ((size_t)1 << 36)
+
+static char *native_memory;
+static size_t native_memory_pages;
+
+static size_t native_memory_size(void)
+{
+  if (!native_memory)
+  {
+    char *reserved = mmap(NULL, WALLOC_NATIVE_RESERVE + PAGE_SIZE, PROT_NONE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    ASSERT(reserved != MAP_FAILED);
+    native_memory = (char *)align((uintptr_t)reserved, PAGE_SIZE);
+  }
+  return ((uintptr_t)native_memory >> PAGE_SIZE_LOG_2) + native_memory_pages;
+}
+
+static size_t native_memory_grow(size_t pages)
+{
+  size_t old = native_memory_size();
+  if ((native_memory_pages + pages) << PAGE_SIZE_LOG_2 > WALLOC_NATIVE_RESERVE)
+    return -1;
+  if (mprotect(native_memory + (native_memory_pages << PAGE_SIZE_LOG_2),
+               pages << PAGE_SIZE_LOG_2, PROT_READ | PROT_WRITE))
+    return -1;
+  native_memory_pages += pages;
+  return old;
+}
+
+#define walloc_memory_size() native_memory_size()
+#define walloc_memory_grow(pages) native_memory_grow(pages)
+#define walloc_heap_base() ((uintptr_t)native_memory)
+
+#define malloc walloc_malloc
+#define free walloc_free
+#else
 extern void __heap_base;
+
+#define walloc_memory_size() __builtin_wasm_memory_size(0)
+#define walloc_memory_grow(pages) __builtin_wasm_memory_grow(0, pages)
+#define walloc_heap_base() ((uintptr_t)&__heap_base)
+#endif
+
 static size_t walloc_heap_size;
 
 static struct page *
 allocate_pages(size_t payload_size, size_t *n_allocated)
 {
   size_t needed = payload_size + PAGE_HEADER_SIZE;
-  size_t heap_size = __builtin_wasm_memory_size(0) * PAGE_SIZE;
+  size_t heap_size = walloc_memory_size() * PAGE_SIZE;
   uintptr_t base = heap_size;
   uintptr_t preallocated = 0, grow = 0;
 
@@ -199,7 +324,7 @@ allocate_pages(size_t payload_size, size_t *n_allocated)
   {
     // We are allocating the initial pages, if any.  We skip the first 64 kB,
     // then take any additional space up to the memory size.
-    uintptr_t heap_base = align((uintptr_t)&__heap_base, PAGE_SIZE);
+    uintptr_t heap_base = align(walloc_heap_base(), PAGE_SIZE);
     preallocated = heap_size - heap_base; // Preallocated pages.
     walloc_heap_size = preallocated;
     base -= preallocated;
@@ -207,11 +332,12 @@ allocate_pages(size_t payload_size, size_t *n_allocated)
 
   if (preallocated < needed)
   {
+    TRACE_SCOPE("walloc grow");
     // Always grow the walloc heap at least by 50%.
     grow = align(max(walloc_heap_size / 2, needed - preallocated),
                  PAGE_SIZE);
     ASSERT(grow);
-    if (__builtin_wasm_memory_grow(0, grow >> PAGE_SIZE_LOG_2) == -1)
+    if (walloc_memory_grow(grow >> PAGE_SIZE_LOG_2) == -1)
     {
       return NULL;
     }
@@ -476,6 +602,125 @@ static inline size_t size_to_granules(size_t size)
 {
   return (size + GRANULE_SIZE - 1) >> GRANULE_SIZE_LOG_2;
 }
+
+#ifdef WALLOC_THREADS
+static unsigned objects_per_chunk(enum chunk_kind kind)
+{
+  return CHUNK_SIZE / (chunk_kind_to_granules(kind) * GRANULE_SIZE);
+}
+
+// Called with the heap lock held.  Take up to a batch of objects off the
+// shared pool, carving a fresh chunk if the pool is empty.
+static struct freelist *
+take_shared_batch(enum chunk_kind kind, unsigned *count)
+{
+  if (shared_batch_counts[kind])
+  {
+    *count = THREAD_CACHE_BATCH;
+    return shared_batches[kind][--shared_batch_counts[kind]];
+  }
+  struct freelist *head = small_object_freelists[kind];
+  if (head)
+  {
+    struct freelist *tail = head;
+    *count = 1;
+    while (*count < THREAD_CACHE_BATCH && tail->next)
+    {
+      tail = tail->next;
+      (*count)++;
+    }
+    small_object_freelists[kind] = tail->next;
+    tail->next = NULL;
+    return head;
+  }
+  head = obtain_small_objects(kind);
+  *count = head ? objects_per_chunk(kind) : 0;
+  return head;
+}
+
+// Called with the heap lock held.  HEAD..TAIL holds COUNT objects.
+static void
+give_shared_batch(enum chunk_kind kind, struct freelist *head,
+                  struct freelist *tail, unsigned count)
+{
+  if (count == THREAD_CACHE_BATCH && shared_batch_counts[kind] < SHARED_BATCHES)
+  {
+    tail->next = NULL;
+    shared_batches[kind][shared_batch_counts[kind]++] = head;
+    return;
+  }
+  tail->next = small_object_freelists[kind];
+  small_object_freelists[kind] = head;
+}
+
+// The thread cache for KIND is empty; refill it and allocate the first
+// object of the new batch.  Out of line, like release_thread_cache_batch(),
+// so that the cached paths of malloc and free save no registers.
+static __attribute__((noinline)) void *
+refill_thread_cache(enum chunk_kind kind)
+{
+  unsigned count = 0;
+  lock_heap();
+  struct freelist *batch = take_shared_batch(kind, &count);
+  unlock_heap();
+  if (!batch)
+    return NULL;
+  thread_cache.freelists[kind] = batch->next;
+  thread_cache.counts[kind] = count - 1;
+  return (void *)batch;
+}
+
+// The thread cache for KIND has grown to two batches; hand the most recently
+// freed batch back to the shared pool.
+static __attribute__((noinline)) void
+release_thread_cache_batch(enum chunk_kind kind)
+{
+  struct freelist *head = thread_cache.freelists[kind], *tail = head;
+  for (unsigned i = 1; i < THREAD_CACHE_BATCH; i++)
+  {
+    tail = tail->next;
+  }
+  thread_cache.freelists[kind] = tail->next;
+  thread_cache.counts[kind] -= THREAD_CACHE_BATCH;
+  lock_heap();
+  give_shared_batch(kind, head, tail, THREAD_CACHE_BATCH);
+  unlock_heap();
+}
+
+// Return every object cached by the calling thread to the shared pool.  Call
+// before a thread exits.
+void walloc_thread_flush(void)
+{
+  for (unsigned kind = 0; kind < SMALL_OBJECT_CHUNK_KINDS; kind++)
+  {
+    struct freelist *head = thread_cache.freelists[kind], *tail = head;
+    if (!head)
+      continue;
+    while (tail->next)
+    {
+      tail = tail->next;
+    }
+    lock_heap();
+    give_shared_batch(kind, head, tail, thread_cache.counts[kind]);
+    unlock_heap();
+    thread_cache.freelists[kind] = NULL;
+    thread_cache.counts[kind] = 0;
+  }
+}
+
+static void *
+allocate_small(enum chunk_kind kind)
+{
+  struct freelist *ret = thread_cache.freelists[kind];
+  if (!ret)
+  {
+    return refill_thread_cache(kind);
+  }
+  thread_cache.freelists[kind] = ret->next;
+  thread_cache.counts[kind]--;
+  return (void *)ret;
+}
+#else
 static struct freelist **get_small_object_freelist(enum chunk_kind kind)
 {
   ASSERT(kind < SMALL_OBJECT_CHUNK_KINDS);
@@ -499,11 +744,14 @@ allocate_small(enum chunk_kind kind)
   *loc = ret->next;
   return (void *)ret;
 }
+#endif
 
 static void *
 allocate_large(size_t size)
 {
+  lock_heap();
   struct large_object *obj = allocate_large_object(size);
+  unlock_heap();
   return obj ? get_large_object_payload(obj) : NULL;
 }
 
@@ -515,6 +763,23 @@ malloc(size_t size)
   return (kind == LARGE_OBJECT) ? allocate_large(size) : allocate_small(kind);
 }
 
+// Out of line in thread-caching mode, where it may wait for the heap lock,
+// to keep that wait out of the small object path.
+#ifdef WALLOC_THREADS
+__attribute__((noinline))
+#endif
+static void
+free_large(void *ptr, struct page *page, unsigned chunk)
+{
+  struct large_object *obj = get_large_object(ptr);
+  lock_heap();
+  obj->next = large_objects;
+  large_objects = obj;
+  allocate_chunk(page, chunk, FREE_LARGE_OBJECT);
+  pending_large_object_compact = 1;
+  unlock_heap();
+}
+
 void free(void *ptr)
 {
   if (!ptr)
@@ -524,18 +789,24 @@ void free(void *ptr)
   uint8_t kind = page->header.chunk_kinds[chunk];
   if (kind == LARGE_OBJECT)
   {
-    struct large_object *obj = get_large_object(ptr);
-    obj->next = large_objects;
-    large_objects = obj;
-    allocate_chunk(page, chunk, FREE_LARGE_OBJECT);
-    pending_large_object_compact = 1;
+    free_large(ptr, page, chunk);
   }
   else
   {
+#ifdef WALLOC_THREADS
+    struct freelist *obj = ptr;
+    obj->next = thread_cache.freelists[kind];
+    thread_cache.freelists[kind] = obj;
+    if (++thread_cache.counts[kind] >= 2 * THREAD_CACHE_BATCH)
+    {
+      release_thread_cache_batch(kind);
+    }
+#else
     size_t granules = kind;
     struct freelist **loc = get_small_object_freelist(granules);
     struct freelist *obj = ptr;
     obj->next = *loc;
     *loc = obj;
+#endif
   }
 }